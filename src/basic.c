@@ -4,13 +4,28 @@
 *                           version 1.0                          *
 *****************************************************************/
 
+/* POSIX can tell whether a stream is a terminal */
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define TERMINALS
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include <math.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <locale.h>
+
+#ifdef TERMINALS
+#include <unistd.h>
+#endif
+
+#include "basic.h"
 
 /* tokens defined */
 #define EOL 0 
@@ -105,369 +120,1455 @@
 #define ERR_EOF 15
 #define ERR_ILLEGALOFFSET 16
 #define ERR_TYPEMISMATCH 17
+#define ERR_NOSUCHLINE 18
+
+/* opcodes for the compiled program */
+#define OP_END 0          /* end of program */
+#define OP_ERROR 1        /* line failed to compile, arg is error code */
+#define OP_PUSHNUM 2      /* push constant val, n set if folded */
+#define OP_LOADVAR 3      /* push scalar variable arg, n set to create */
+#define OP_LOADDIM 4      /* push element of array arg, n subscripts */
+#define OP_STOREVAR 5     /* pop into scalar variable arg */
+#define OP_STOREDIM 6     /* pop into element of array arg, n subscripts */
+#define OP_ADD 7
+#define OP_SUB 8
+#define OP_MUL 9
+#define OP_DIV 10
+#define OP_MOD 11
+#define OP_NEG 12
+#define OP_FACT 13
+#define OP_SIN 14
+#define OP_COS 15
+#define OP_TAN 16
+#define OP_LN 17
+#define OP_POW 18
+#define OP_SQRT 19
+#define OP_ABS 20
+#define OP_ASIN 21
+#define OP_ACOS 22
+#define OP_ATAN 23
+#define OP_INT 24
+#define OP_RND 25
+#define OP_CMP 26         /* compare numbers, arg is relational operator */
+#define OP_AND 27
+#define OP_OR 28
+#define OP_PUSHLIT 29     /* push literal at arg in the pool, n characters */
+#define OP_LOADSTR 30     /* push string variable arg, n set to create */
+#define OP_LOADDIMSTR 31
+#define OP_STORESTR 32
+#define OP_STOREDIMSTR 33
+#define OP_CONCAT 34      /* join the top n strings */
+#define OP_SCMP 35        /* compare strings, arg is relational operator */
+#define OP_LEN 36
+#define OP_ASCII 37
+#define OP_VAL 38
+#define OP_CHR 39
+#define OP_STR 40
+#define OP_LEFT 41
+#define OP_RIGHT 42
+#define OP_MID 43
+#define OP_STRING 44
+#define OP_PRINTNUM 45
+#define OP_PRINTSTR 46
+#define OP_PRINTCHAR 47   /* print character arg */
+#define OP_INPUTNUM 48
+#define OP_INPUTSTR 49
+#define OP_DIM 50         /* dimension array arg, n dimensions */
+#define OP_DIMINIT 51     /* pop into element n of array arg */
+#define OP_DIMINITSTR 52
+#define OP_GOTO 53
+#define OP_IF 54
+#define OP_FOR 55         /* arg is the counting variable */
+#define OP_NEXT 56
+#define OP_JUMP 57        /* jump to instruction arg */
+#define OP_JUMPIF 58      /* pop condition, jump to instruction arg if set */
+#define OP_LOADDIMV 59    /* push arg(v), v the variable of FOR at n */
+#define OP_STOREDIMV 60   /* pop into arg(v), v the variable of FOR at n */
+#define OP_APPENDSTR 61   /* append the top n strings to string variable arg */
+#define NOPS 62
+
+/* widest spread of line numbers given a dense jump table */
+#define MAXLINESPAN(nlines) ((nlines) * 32 + 4096)
+
+#define ARENACHUNK 65536  /* bytes in each slab of the run arena */
+#define NCLASSES 12       /* arena size classes, 16 bytes to 32K */
+#define BIGCLASS -1       /* class of a block too big for the classes */
+
+#define SMALLSTRING 15    /* longest string kept in place in a variable */
+
+#define OUTBLOCK 8192     /* PRINT output written out in blocks of this */
+#define INBLOCK 8192      /* input asked of a reader at a time */
+#define MAXDIGITS 800     /* significant digits kept reading a number, enough to round any double */
+#define MAXEXPONENT 100000000L /* exponents are held at this, past any double */
+
+#define KWMULT 0x4163202DUL /* perfect hash multiplier for the keywords */
+#define KWHASH(str, len) \
+  ((((((unsigned long) (unsigned char) (str)[0] << 16) | \
+  ((unsigned long) (unsigned char) (str)[1] << 8) | \
+  (unsigned long) (unsigned char) (str)[(len)-1]) + (len)) * KWMULT & 0xFFFFFFFFUL) >> 26)
+
+/* labels as values allow computed goto dispatch */
+#if defined(__GNUC__) && !defined(BASIC_NOTHREADED)
+#define THREADED
+#endif
 
 typedef struct
 {
   int no;
   const char *str;
+  int tok;           /* index of first token in token stream */
+  int code;          /* index of first instruction */
 }LINE;
 
 typedef struct
 {
-  char id[32];
+  int type;          /* token type */
+  int id;            /* identifier handle, or error code for ERROR */
+  int len;           /* length of token in script */
+  double value;      /* value of a VALUE */
+  const char *str;   /* start of token in script */
+} TOKEN;
+
+typedef struct
+{
+  int op;            /* opcode */
+  int arg;           /* identifier handle, operator or error code */
+  int n;             /* number of subscripts, or flag */
+  int link;          /* for OP_FOR, the instruction after its NEXT */
+  double val;        /* value of a constant */
+} INSTR;
+
+typedef struct
+{
+  int dpop;          /* numbers popped */
+  int dpush;         /* numbers pushed */
+  int spop;          /* strings popped */
+  int spush;         /* strings pushed */
+  int popn;          /* set if n further numbers are popped */
+  int spopn;         /* set if n strings are popped */
+} OPINFO;
+
+/* a string kept in a variable, shared by reference */
+typedef struct
+{
+  int len;           /* number of characters */
+  int cap;           /* room for characters, not counting the nul */
+  int refs;          /* holders of the string, only changed if 1 */
+  char str[1];       /* the characters, nul-terminated */
+} STRING;
+
+#define STRINGSIZE(cap) (sizeof(STRING) + (cap))
+
+/* a string variable or array element, all zero for "" */
+typedef struct
+{
+  int len;           /* number of characters */
+  union
+  {
+	char small[SMALLSTRING + 1]; /* the characters, if len <= SMALLSTRING */
+	STRING *big;     /* the string, if it is longer */
+  } u;
+} STRSLOT;
+
+#define SLOTCHARS(slot) \
+  ((slot)->len <= SMALLSTRING ? (slot)->u.small : (slot)->u.big->str)
+
+typedef struct
+{
+  int defined;       /* set once the variable has been assigned */
   double dval;
-  int ival;
-  char *sval;
+  STRSLOT sval;
+  int inrange;       /* OP_FOR proving array accesses safe, 0 if none */
+  int dimstamp;      /* ndimops when it was proved */
 } VARIABLE;
 
+/* a string on the string stack */
+typedef struct
+{
+  const char *str;   /* the characters, not always nul-terminated */
+  int len;           /* number of characters */
+  STRING *mem;       /* reference to the string holding them, 0 if borrowed */
+} STRVAL;
+
 typedef struct
 {
-  char id[32];
   int type;
   int ndims;
   int dim[5];
-  char **str;
+  int stride[5];     /* step between successive values of each subscript */
+  int size;          /* total number of elements */
+  STRSLOT *str;
   double *dval;
 } DIMVAR;
 
 typedef struct
 {
-  int type;   
-  char **sval;
-  double *dval;
-  int *ival;
+  int type;          /* FLTID or STRID, ERROR if not an lvalue */
+  int id;            /* identifier handle */
+  int ndims;         /* number of subscripts, 0 for a scalar */
+  int forpc;         /* FOR whose variable is the subscript, or -1 */
 } LVALUE;
 
 typedef struct
 {
-  char id[32];
-  int nextline;
+  int id;            /* array indexed by a FOR loop's variable */
+  int next;          /* next check for the same loop, -1 for none */
+} RANGECHECK;
+
+typedef struct
+{
+  const INSTR *next; /* first instruction after the FOR */
   double toval;
   double step;
 } FORLOOP;
 
-static FORLOOP forstack[32];
-static int nfors;
-
-static VARIABLE *variables;
-static int nvariables;
-
-static DIMVAR *dimvariables;
-static int ndimvariables;
+typedef struct
+{
+  const char *name;  /* keyword, with $ for a string function */
+  int len;           /* length of name, 0 for an empty slot */
+  int token;
+} KEYWORD;
 
-static LINE *lines;
-static int nlines;
+/* header in front of each block from the run arena */
+typedef union
+{
+  double d;          /* for alignment */
+  void *p;
+  long cls;          /* size class, or BIGCLASS */
+} BLOCKHEAD;
 
-static FILE *fpin;
-static FILE *fpout;
-static FILE *fperr;
+typedef struct bigblock
+{
+  struct bigblock *prev;
+  struct bigblock *next;
+  size_t size;
+  BLOCKHEAD head;
+} BIGBLOCK;
 
-static const char *string;        /* string we are parsing */
-static int token;                 /* current token (lookahead) */
-static int errorflag;             /* set when error in input encountered */
+typedef struct chunk
+{
+  struct chunk *next;
+  BLOCKHEAD data[1]; /* ARENACHUNK bytes */
+} CHUNK;
 
+/* stack effects of each opcode */
+static const OPINFO opinfo[] =
+{
+  {0, 0, 0, 0, 0, 0},   /* OP_END */
+  {0, 0, 0, 0, 0, 0},   /* OP_ERROR */
+  {0, 1, 0, 0, 0, 0},   /* OP_PUSHNUM */
+  {0, 1, 0, 0, 0, 0},   /* OP_LOADVAR */
+  {0, 1, 0, 0, 1, 0},   /* OP_LOADDIM */
+  {1, 0, 0, 0, 0, 0},   /* OP_STOREVAR */
+  {1, 0, 0, 0, 1, 0},   /* OP_STOREDIM */
+  {2, 1, 0, 0, 0, 0},   /* OP_ADD */
+  {2, 1, 0, 0, 0, 0},   /* OP_SUB */
+  {2, 1, 0, 0, 0, 0},   /* OP_MUL */
+  {2, 1, 0, 0, 0, 0},   /* OP_DIV */
+  {2, 1, 0, 0, 0, 0},   /* OP_MOD */
+  {1, 1, 0, 0, 0, 0},   /* OP_NEG */
+  {1, 1, 0, 0, 0, 0},   /* OP_FACT */
+  {1, 1, 0, 0, 0, 0},   /* OP_SIN */
+  {1, 1, 0, 0, 0, 0},   /* OP_COS */
+  {1, 1, 0, 0, 0, 0},   /* OP_TAN */
+  {1, 1, 0, 0, 0, 0},   /* OP_LN */
+  {2, 1, 0, 0, 0, 0},   /* OP_POW */
+  {1, 1, 0, 0, 0, 0},   /* OP_SQRT */
+  {1, 1, 0, 0, 0, 0},   /* OP_ABS */
+  {1, 1, 0, 0, 0, 0},   /* OP_ASIN */
+  {1, 1, 0, 0, 0, 0},   /* OP_ACOS */
+  {1, 1, 0, 0, 0, 0},   /* OP_ATAN */
+  {1, 1, 0, 0, 0, 0},   /* OP_INT */
+  {1, 1, 0, 0, 0, 0},   /* OP_RND */
+  {2, 1, 0, 0, 0, 0},   /* OP_CMP */
+  {2, 1, 0, 0, 0, 0},   /* OP_AND */
+  {2, 1, 0, 0, 0, 0},   /* OP_OR */
+  {0, 0, 0, 1, 0, 0},   /* OP_PUSHLIT */
+  {0, 0, 0, 1, 0, 0},   /* OP_LOADSTR */
+  {0, 0, 0, 1, 1, 0},   /* OP_LOADDIMSTR */
+  {0, 0, 1, 0, 0, 0},   /* OP_STORESTR */
+  {0, 0, 1, 0, 1, 0},   /* OP_STOREDIMSTR */
+  {0, 0, 0, 1, 0, 1},   /* OP_CONCAT */
+  {0, 1, 2, 0, 0, 0},   /* OP_SCMP */
+  {0, 1, 1, 0, 0, 0},   /* OP_LEN */
+  {0, 1, 1, 0, 0, 0},   /* OP_ASCII */
+  {0, 1, 1, 0, 0, 0},   /* OP_VAL */
+  {1, 0, 0, 1, 0, 0},   /* OP_CHR */
+  {1, 0, 0, 1, 0, 0},   /* OP_STR */
+  {1, 0, 1, 1, 0, 0},   /* OP_LEFT */
+  {1, 0, 1, 1, 0, 0},   /* OP_RIGHT */
+  {2, 0, 1, 1, 0, 0},   /* OP_MID */
+  {1, 0, 1, 1, 0, 0},   /* OP_STRING */
+  {1, 0, 0, 0, 0, 0},   /* OP_PRINTNUM */
+  {0, 0, 1, 0, 0, 0},   /* OP_PRINTSTR */
+  {0, 0, 0, 0, 0, 0},   /* OP_PRINTCHAR */
+  {0, 1, 0, 0, 0, 0},   /* OP_INPUTNUM */
+  {0, 0, 0, 1, 0, 0},   /* OP_INPUTSTR */
+  {0, 0, 0, 0, 1, 0},   /* OP_DIM */
+  {1, 0, 0, 0, 0, 0},   /* OP_DIMINIT */
+  {0, 0, 1, 0, 0, 0},   /* OP_DIMINITSTR */
+  {1, 0, 0, 0, 0, 0},   /* OP_GOTO */
+  {2, 0, 0, 0, 0, 0},   /* OP_IF */
+  {3, 0, 0, 0, 0, 0},   /* OP_FOR */
+  {0, 0, 0, 0, 0, 0},   /* OP_NEXT */
+  {0, 0, 0, 0, 0, 0},   /* OP_JUMP */
+  {1, 0, 0, 0, 0, 0},   /* OP_JUMPIF */
+  {0, 1, 0, 0, 0, 0},   /* OP_LOADDIMV */
+  {1, 0, 0, 0, 0, 0},   /* OP_STOREDIMV */
+  {0, 0, 0, 0, 0, 1},   /* OP_APPENDSTR */
+};
 
-static int setup(const char *script);
-static void cleanup(void);
+/*
+  keywords by KWHASH of their names, which puts no two in one slot.
+  The multiplier was found by a search over odd 32 bit numbers, it
+  must be searched for again if a keyword is added.
+*/
+static const KEYWORD keywords[64] =
+{
+  {"tan", 3, TAN},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"FOR", 3, FOR},
+  {"INPUT", 5, INPUT},
+  {"OR", 2, OR},
+  {"VAL", 3, VAL},
+  {"MID$", 4, MIDSTRING},
+  {"STR$", 4, STRSTRING},
+  {"", 0, 0},
+  {"pow", 3, POW},
+  {"ASCII", 5, ASCII},
+  {"DIM", 3, DIM},
+  {"ASIN", 4, ASIN},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"RIGHT$", 6, RIGHTSTRING},
+  {"", 0, 0},
+  {"ACOS", 4, ACOS},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"THEN", 4, THEN},
+  {"MOD", 3, MOD},
+  {"STEP", 4, STEP},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"REM", 3, REM},
+  {"PI", 2, PI},
+  {"LET", 3, LET},
+  {"AND", 3, AND},
+  {"CHR$", 4, CHRSTRING},
+  {"PRINT", 5, PRINT},
+  {"", 0, 0},
+  {"cos", 3, COS},
+  {"", 0, 0},
+  {"INT", 3, INT},
+  {"", 0, 0},
+  {"ATAN", 4, ATAN},
+  {"RND", 3, RND},
+  {"IF", 2, IF},
+  {"", 0, 0},
+  {"ABS", 3, ABS},
+  {"GOTO", 4, GOTO},
+  {"", 0, 0},
+  {"LEFT$", 5, LEFTSTRING},
+  {"", 0, 0},
+  {"ln", 2, LN},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"TO", 2, TO},
+  {"sqrt", 4, SQRT},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"", 0, 0},
+  {"STRING$", 7, STRINGSTRING},
+  {"LEN", 3, LEN},
+  {"sin", 3, SIN},
+  {"NEXT", 4, NEXT}
+};
+
+/* powers of ten which a double holds exactly */
+static const double powersoften[23] =
+{
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-static void reporterror(int lineno);
-static int findline(int no);
+/* a compiled script, not changed by running it */
+struct mb_program
+{
+  char *script;              /* copy of the script text */
 
-static int line(void);
-static void doprint(void);
-static void dolet(void);
-static void dodim(void);
-static int doif(void);
-static int dogoto(void);
-static void doinput(void);
-static void dorem(void);
-static int dofor(void);
-static int donext(void);
+  LINE *lines;
+  int nlines;
 
-static void lvalue(LVALUE *lv);
+  TOKEN *tokens;
+  int ntokens;
+  int maxtokens;
 
-static int boolexpr(void);
-static int boolfactor(void);
-static int relop(void);
+  char (*idnames)[32];
+  int nids;
+  int maxids;
+  int *idhash;               /* open hash table of handles */
+  int idhashsize;
 
+  INSTR *code;
+  int ncode;
+  int maxcode;
 
-static double expr(void);
-static double term(void);
-static double factor(void);
-static double variable(void);
-static double dimvariable(void);
+  int *linecode;             /* first instruction by line number */
+  int minlineno;             /* line number of linecode[0] */
+  int nlinecode;
 
+  RANGECHECK *checks;        /* arrays to check on entry to a FOR */
+  int nchecks;
+  int maxchecks;
 
-static VARIABLE *findvariable(const char *id);
-static DIMVAR *finddimvar(const char *id);
-static DIMVAR *dimension(const char *id, int ndims, ...);
-static void *getdimvar(DIMVAR *dv, ...);
-static VARIABLE *addfloat(const char *id);
-static VARIABLE *addstring(const char *id);
-static DIMVAR *adddimvar(const char *id);
+  char *pool;                /* string literals, decoded and nul-terminated */
+  int poolsize;
+  int maxpool;
 
-static char *stringexpr(void);
-static char *chrstring(void);
-static char *strstring(void);
-static char *leftstring(void);
-static char *rightstring(void);
-static char *midstring(void);
-static char *stringstring(void);
-static char *stringdimvar(void);
-static char *stringvar(void);
-static char *stringliteral(void);
+  int maxddepth;             /* deepest the number stack gets */
+  int maxsdepth;             /* deepest the string stack gets */
+};
 
-static void match(int tok);
-static void seterror(int errorcode);
-static int getnextline(const char *str);
-static int gettoken(const char *str);
-static int tokenlen(const char *str, int token);
+/* state of one interpreter */
+struct mb_context
+{
+  mb_program *build;         /* program being compiled */
+  const mb_program *prog;    /* program being run */
+
+  FORLOOP forstack[32];
+  int nfors;
+  int ndimops;               /* DIMs executed, to invalidate proofs */
+
+  VARIABLE *variables;       /* scalars, by identifier handle */
+  DIMVAR *dimvariables;      /* arrays, by identifier handle */
+
+  int forcode[32];           /* FORs open while compiling */
+  int nforcode;
+  int *lithash;              /* open hash table of literals in the pool */
+  int lithashsize;
+  int nlits;
+  int target;                /* scalar being assigned, -1 if none */
+  int ddepth;                /* depth of number stack */
+  int sdepth;                /* depth of string stack */
+
+  FILE *fpin;                /* 0 when reading from memory or a reader */
+  FILE *fpout;               /* 0 when writing to memory or a writer */
+  FILE *fperr;
+
+  const char *inptr;         /* next character of input in memory */
+  const char *inend;         /* end of input in memory */
+  const char *inmem;         /* caller's input, 0 if none */
+  size_t inmemlen;
+  mb_reader reader;          /* caller's input function, 0 if none */
+  void *readarg;
+  char *inblock;             /* what the reader last gave */
+
+  mb_writer writer;          /* caller's output function, 0 if none */
+  void *writearg;
+  mb_writer errwriter;       /* caller's error function, 0 to use fperr */
+  void *errarg;
+
+  char *outbuf;              /* PRINT output waiting to be written */
+  size_t outlen;             /* characters in outbuf */
+  size_t outsize;            /* space in outbuf */
+  size_t outlost;            /* output which didn't fit in outmem */
+  char *outblock;            /* outbuf when writing to fpout or writer */
+  char *outmem;              /* caller's buffer, 0 to write to fpout */
+  size_t outmemsize;
+  size_t outmemlen;          /* length of the last run's output */
+  int flushmode;             /* BASIC_FLUSHAUTO, FULL or LINE */
+  int lineflush;             /* write out at the end of each line */
+  int inputflush;            /* write out before each INPUT */
+
+  const TOKEN *curtok;       /* token we are parsing */
+  int token;                 /* current token (lookahead) */
+  int errorflag;             /* set when error in input encountered */
+
+  unsigned long seed;        /* state of the random number generator */
+
+  int usearena;              /* run memory comes from the arena */
+  CHUNK *chunks;             /* arena slabs, kept between runs */
+  CHUNK *chunk;              /* slab being allocated from */
+  char *bump;                /* next free byte in chunk */
+  char *bumpend;             /* end of chunk */
+  void *freeblocks[NCLASSES]; /* freed blocks by size class */
+  BIGBLOCK *bigblocks;       /* blocks too big for a size class */
+};
+
+#ifdef THREADED
+static int dispatchmethod = BASIC_THREADED;
+#else
+static int dispatchmethod = BASIC_SWITCH;
+#endif
+
+
+static mb_program *compilescript(const char *script, FILE *err, mb_writer errwriter, void *errarg);
+static int setup(mb_context *ctx, const char *script);
+static int tokenize(mb_context *ctx, const char *str, const char *end);
+static int addtoken(mb_context *ctx, int type, int id, double value, const char *str, int len);
+static int internid(mb_context *ctx, const char *id, int len);
+static int rehashids(mb_context *ctx);
+static unsigned hashid(const char *id, int len);
+static int allocvariables(mb_context *ctx);
+static int compile(mb_context *ctx);
+static void cleanup(mb_context *ctx);
+
+static void reporterror(mb_context *ctx, int lineno);
+static int findline(const mb_program *prog, int no);
+static int findcodeline(const mb_program *prog, const INSTR *pc);
+static int resolvejumps(mb_context *ctx);
+static int pairloops(mb_context *ctx);
+static int errorloopvar(mb_program *prog, int i, int keyword);
+
+static int execute(mb_context *ctx);
+static const INSTR *jumpline(mb_context *ctx, double x);
+static int checkrange(mb_context *ctx, const INSTR *pc, double from, double to, double step);
+
+static void line(mb_context *ctx);
+static void doprint(mb_context *ctx);
+static void dolet(mb_context *ctx);
+static void dodim(mb_context *ctx);
+static void doif(mb_context *ctx);
+static void dogoto(mb_context *ctx);
+static void doinput(mb_context *ctx);
+static void dorem(mb_context *ctx);
+static void dofor(mb_context *ctx);
+static void donext(mb_context *ctx);
+
+static void lvalue(mb_context *ctx, LVALUE *lv);
+static void storelvalue(mb_context *ctx, const LVALUE *lv);
+static int subscripts(mb_context *ctx);
+static int hoistcheck(mb_context *ctx, int id, int start, int nsubs);
+
+static void boolexpr(mb_context *ctx);
+static void boolfactor(mb_context *ctx);
+static int relop(mb_context *ctx);
+
+
+static void expr(mb_context *ctx);
+static void term(mb_context *ctx);
+static void factor(mb_context *ctx);
+static void builtin(mb_context *ctx, int tok, int op, int argtype);
+static void stringexpr(mb_context *ctx);
+static void stringterm(mb_context *ctx);
+
+static INSTR *emit(mb_context *ctx, int op, int arg, int n);
+static void emitvalue(mb_context *ctx, double x);
+static int emitjump(mb_context *ctx, int start, int op);
+static void emitunary(mb_context *ctx, int op, int start);
+static void emitbinary(mb_context *ctx, int op, int left, int right);
+static int foldconstant(int op, double *x, double y);
+static int internliteral(mb_context *ctx, int tok, int n, int *len);
+static int rehashliterals(mb_context *ctx);
+
+
+static DIMVAR *finddimvar(mb_context *ctx, int id);
+static DIMVAR *dimension(mb_context *ctx, DIMVAR *dv, int ndims, const int *dims);
+static void *getdimvar(mb_context *ctx, DIMVAR *dv, const double *subs);
+static DIMVAR *dimarray(mb_context *ctx, int id, int ndims, const double *dims);
+static void *getelement(mb_context *ctx, int id, int nsubs, const double *subs);
+static void initarray(mb_context *ctx, int id, int i, double x, STRVAL *sv);
+
+static double rnd(mb_context *ctx, double x);
+static long myrand(mb_context *ctx);
+static int inputnumber(mb_context *ctx, double *x);
+static int readnumber(mb_context *ctx, double *x);
+static int readspecial(mb_context *ctx, int ch, double *x);
+static int inputstring(mb_context *ctx, STRVAL *sv);
+static int nextchar(mb_context *ctx);
+static void backchar(mb_context *ctx, int ch);
+static int fillinput(mb_context *ctx);
+static void writeoutput(mb_context *ctx, const char *str, int len);
+static void flushoutput(mb_context *ctx, int push);
+static void writeerror(mb_context *ctx, const char *msg);
+static int isterminal(FILE *fp);
+
+static STRING *chrstring(mb_context *ctx, double x);
+static STRING *strstring(mb_context *ctx, double x);
+static void leftstring(mb_context *ctx, STRVAL *sv, double x);
+static void rightstring(mb_context *ctx, STRVAL *sv, double x);
+static void midstring(mb_context *ctx, STRVAL *sv, double x, double len);
+static void stringstring(mb_context *ctx, double x, STRVAL *sv);
+static double valstring(mb_context *ctx, const STRVAL *sv);
+static STRING *takestring(mb_context *ctx, STRVAL *sv);
+static int storestring(mb_context *ctx, STRSLOT *slot, STRVAL *sv);
+static int appendstring(mb_context *ctx, STRSLOT *slot, const STRVAL *strs, int n);
+static int numcompare(double left, double right, int rop);
+static int strcompare(const STRVAL *left, const STRVAL *right, int rop);
+
+static void match(mb_context *ctx, int tok);
+static void seterror(mb_context *ctx, int errorcode);
+static int gettoken(const char *str, const char *end, int *len, double *value);
+static const KEYWORD *findkeyword(const char *str, int len);
 
 static int isstring(int token);
-static double getvalue(const char *str, int *len);
-static void getid(const char *str, char *out, int *len);
 
 static void mystrgrablit(char *dest, const char *src);
 static char *mystrend(const char *str, char quote);
 static int mystrcount(const char *str, char ch);
 static char *mystrdup(const char *str);
-static char *mystrconcat(const char *str, const char *cat);
+static int parsenumber(const char *str, int len, double *x);
+static int cstrtod(const char *str, int len, double *x);
+static int formatnumber(char *buff, double x);
+static int formatg(char *buff, double x);
+static double scaleten(double x, int n);
 static double factorial(double x);
 
+static void *runalloc(mb_context *ctx, size_t size);
+static void *runrealloc(mb_context *ctx, void *ptr, size_t size);
+static void runfree(mb_context *ctx, void *ptr);
+static STRING *newstring(mb_context *ctx, const char *str, int len);
+static void dropstring(mb_context *ctx, STRING *str);
+static STRING *runconcat(mb_context *ctx, const STRVAL *strs, int n);
+static int newchunk(mb_context *ctx);
+static void resetarena(mb_context *ctx);
+static void freearena(mb_context *ctx);
+
+/*
+  run a script, the original single call interface.
+  Params: script - the script to run
+		  in - input stream
+		  out - output stream
+		  err - error stream
+  Returns: 0 on success, 1 on error condition.
+*/
 int basic(const char *script, FILE *in, FILE *out, FILE *err)
 {
-  int curline = 0;
-  int nextline;
-  int answer = 0;
+  mb_context *ctx;
+  int answer;
+
+  ctx = mb_create();
+  if(!ctx)
+  {
+	if(err)
+	  fprintf(err, "Out of memory\n");
+	return 1;
+  }
+  answer = mb_run(ctx, script, in, out, err);
+  mb_destroy(ctx);
 
-  fpin = in;
-  fpout = out;
-  fperr = err;
+  return answer;
+}
 
-  if( setup(script) == -1 )
-    return 1;
-  
-  while(curline != -1)
+/*
+  create an interpreter.
+  Returns: the interpreter, 0 on out of memory
+  Notes: an interpreter may only be used by one thread at a time,
+		 but any number may run at once.
+*/
+mb_context *mb_create(void)
+{
+  mb_context *ctx;
+
+  ctx = malloc(sizeof(mb_context));
+  if(!ctx)
+	return 0;
+  memset(ctx, 0, sizeof(mb_context));
+
+  return ctx;
+}
+
+/*
+  destroy an interpreter.
+  Params: ctx - interpreter from mb_create()
+*/
+void mb_destroy(mb_context *ctx)
+{
+  if(ctx)
   {
-    string = lines[curline].str;
-	token = gettoken(string);
-	errorflag = 0;
+	freearena(ctx);
+	if(ctx->outblock)
+	  free(ctx->outblock);
+	if(ctx->inblock)
+	  free(ctx->inblock);
+	free(ctx);
+  }
+}
 
-	nextline = line();
-	if(errorflag)
-	{
-      reporterror(lines[curline].no);
-	  break;
-	}
+/*
+  choose whether an interpreter takes the memory for a run from an arena.
+  Params: ctx - interpreter from mb_create()
+		  on - 1 to use an arena, 0 to use malloc() for each block
+  Notes: must not be called during a run. The arena's memory is kept
+		 from one run to the next, and given back all at once at the
+		 end of each run, so is best when running short scripts
+		 many times.
+*/
+void mb_usearena(mb_context *ctx, int on)
+{
+  if(!on)
+	freearena(ctx);
+  ctx->usearena = on ? 1 : 0;
+}
 
-	if(nextline == -1)
-	  break;
+/*
+  choose when an interpreter writes out what PRINT has written.
+  Params: ctx - interpreter from mb_create()
+		  mode - BASIC_FLUSHAUTO, BASIC_FLUSHFULL or BASIC_FLUSHLINE
+  Notes: output is kept in a buffer and written in large blocks.
+		 It is always written out before INPUT reads from a
+		 terminal, and at the end of the run. BASIC_FLUSHLINE also
+		 writes it out at the end of each line, BASIC_FLUSHAUTO
+		 does so only if the output is a terminal.
+*/
+void mb_flushmode(mb_context *ctx, int mode)
+{
+  if(mode == BASIC_FLUSHAUTO || mode == BASIC_FLUSHFULL || mode == BASIC_FLUSHLINE)
+	ctx->flushmode = mode;
+}
 
-	if(nextline == 0)
-	{
-      curline++;
-	  if(curline == nlines)
-	    break;
-    }
-	else
-    {
-      curline = findline(nextline);
-	  if(curline == -1)
-	  {
-	    fprintf(fperr, "line %d not found\n", nextline);
-		answer = 1;
-		break;
-	  }
-    }
+/*
+  send an interpreter's output to memory instead of a stream.
+  Params: ctx - interpreter from mb_create()
+		  buff - buffer for the output, 0 to go back to streams
+		  size - size of buff
+  Notes: must not be called during a run. Each run then writes to
+		 buff from the start, and the out stream passed to
+		 mb_execute() or mb_run() is not used, so may be 0. Any
+		 writer set by mb_setwriter() is dropped. The
+		 output is nul-terminated, and output that doesn't fit is
+		 lost, but still counted by mb_outputlen().
+*/
+void mb_setoutput(mb_context *ctx, char *buff, size_t size)
+{
+  ctx->writer = 0;
+  ctx->writearg = 0;
+  ctx->outmem = buff;
+  ctx->outmemsize = buff ? size : 0;
+  ctx->outmemlen = 0;
+}
+
+/*
+  get the length of the output of the last run to memory.
+  Params: ctx - interpreter from mb_create()
+  Returns: the length, not counting the nul, of all that was
+		   written, even if it didn't fit.
+*/
+size_t mb_outputlen(const mb_context *ctx)
+{
+  return ctx->outmemlen;
+}
+
+/*
+  send an interpreter's output to a function instead of a stream.
+  Params: ctx - interpreter from mb_create()
+		  write - called with each block of output, 0 to go back
+				  to streams
+		  arg - passed to write
+  Notes: must not be called during a run. The out stream is then
+		 not used, and any buffer set by mb_setoutput() is dropped.
+		 Blocks are passed as mb_flushmode() says, as they are to
+		 a stream.
+*/
+void mb_setwriter(mb_context *ctx, mb_writer write, void *arg)
+{
+  ctx->outmem = 0;
+  ctx->outmemsize = 0;
+  ctx->outmemlen = 0;
+  ctx->writer = write;
+  ctx->writearg = write ? arg : 0;
+}
+
+/*
+  send an interpreter's error messages to a function.
+  Params: ctx - interpreter from mb_create()
+		  write - called with each message, 0 to go back to the
+				  err stream
+		  arg - passed to write
+  Notes: must not be called during a run. Run time errors go to
+		 write, and so do load errors when the script is loaded by
+		 mb_run(); mb_compile() has no interpreter, so reports to
+		 its stream. Output is written out before each message, so
+		 both may go to the same place.
+*/
+void mb_seterrorwriter(mb_context *ctx, mb_writer write, void *arg)
+{
+  ctx->errwriter = write;
+  ctx->errarg = write ? arg : 0;
+}
+
+/*
+  have an interpreter's INPUT read from memory instead of a stream.
+  Params: ctx - interpreter from mb_create()
+		  buff - the input, 0 to go back to streams
+		  len - length of the input
+  Notes: must not be called during a run. Each run reads buff
+		 from the start, and the in stream is not used. The input
+		 isn't copied, so must stay as it is until the run ends,
+		 and INPUT of a string takes the line straight from it.
+		 Any reader set by mb_setreader() is dropped.
+*/
+void mb_setinput(mb_context *ctx, const char *buff, size_t len)
+{
+  ctx->reader = 0;
+  ctx->readarg = 0;
+  ctx->inmem = buff;
+  ctx->inmemlen = buff ? len : 0;
+}
+
+/*
+  have an interpreter's INPUT read from a function instead of a stream.
+  Params: ctx - interpreter from mb_create()
+		  read - called for more input, 0 to go back to streams
+		  arg - passed to read
+  Notes: must not be called during a run. The in stream is then
+		 not used, and any buffer set by mb_setinput() is dropped.
+		 Output is written out before each call, so read may
+		 prompt a user. Input read ahead in one run is not kept
+		 for the next.
+*/
+void mb_setreader(mb_context *ctx, mb_reader read, void *arg)
+{
+  ctx->inmem = 0;
+  ctx->inmemlen = 0;
+  ctx->reader = read;
+  ctx->readarg = read ? arg : 0;
+}
+
+/*
+  compile and run a script with an interpreter.
+  Params: ctx - interpreter from mb_create()
+		  script - the script to run
+		  in - input stream
+		  out - output stream
+		  err - error stream
+  Returns: 0 on success, 1 if the script could not be loaded.
+  Notes: load errors, like run time errors, go to the interpreter's
+		 error writer if it has one.
+*/
+int mb_run(mb_context *ctx, const char *script, FILE *in, FILE *out, FILE *err)
+{
+  mb_program *prog;
+
+  prog = compilescript(script, err, ctx->errwriter, ctx->errarg);
+  if(!prog)
+	return 1;
+  mb_execute(ctx, prog, in, out, err);
+  mb_freeprogram(prog);
+
+  return 0;
+}
+
+/*
+  compile a script.
+  Params: script - the script to compile
+		  err - stream for load errors
+  Returns: the compiled program, 0 on fail.
+  Notes: the program takes a copy of the script. It is not changed
+		 by running it, so may be run any number of times, by any
+		 number of interpreters.
+*/
+mb_program *mb_compile(const char *script, FILE *err)
+{
+  return compilescript(script, err, 0, 0);
+}
+
+/*
+  compile a script, for mb_compile() and mb_run().
+  Params: script - the script to compile
+		  err - stream for load errors
+		  errwriter - function for load errors, 0 to use err
+		  errarg - passed to errwriter
+  Returns: the compiled program, 0 on fail.
+*/
+static mb_program *compilescript(const char *script, FILE *err, mb_writer errwriter, void *errarg)
+{
+  mb_context ctx;
+  mb_program *prog;
+  int answer;
+
+  memset(&ctx, 0, sizeof(mb_context));
+  ctx.fperr = err;
+  ctx.errwriter = errwriter;
+  ctx.errarg = errarg;
+
+  prog = malloc(sizeof(mb_program));
+  if(!prog)
+  {
+	writeerror(&ctx, "Out of memory\n");
+	return 0;
+  }
+  memset(prog, 0, sizeof(mb_program));
+  ctx.build = prog;
+
+  answer = setup(&ctx, script);
+  if(ctx.lithash)
+	free(ctx.lithash);
+  if(answer == -1)
+  {
+	mb_freeprogram(prog);
+	return 0;
+  }
+
+  return prog;
+}
+
+/*
+  free a compiled program.
+  Params: prog - program from mb_compile()
+*/
+void mb_freeprogram(mb_program *prog)
+{
+  if(!prog)
+	return;
+
+  if(prog->script)
+	free(prog->script);
+  if(prog->lines)
+	free(prog->lines);
+  if(prog->tokens)
+	free(prog->tokens);
+  if(prog->idnames)
+	free(prog->idnames);
+  if(prog->idhash)
+	free(prog->idhash);
+  if(prog->code)
+	free(prog->code);
+  if(prog->linecode)
+	free(prog->linecode);
+  if(prog->checks)
+	free(prog->checks);
+  if(prog->pool)
+	free(prog->pool);
+  free(prog);
+}
+
+/*
+  run a compiled program.
+  Params: ctx - interpreter from mb_create()
+		  prog - program from mb_compile()
+		  in - input stream
+		  out - output stream
+		  err - error stream
+  Returns: 0 on success, 1 on a run time error.
+  Notes: variables and the random numbers start afresh on each run.
+		 The program is not written, so several threads may run it
+		 at once as long as each has its own interpreter.
+*/
+int mb_execute(mb_context *ctx, const mb_program *prog, FILE *in, FILE *out, FILE *err)
+{
+  int answer;
+
+  ctx->prog = prog;
+  ctx->fpin = (ctx->inmem || ctx->reader) ? 0 : in;
+  ctx->fpout = (ctx->outmem || ctx->writer) ? 0 : out;
+  ctx->fperr = err;
+  ctx->seed = 1;
+
+  ctx->inptr = ctx->inmem;
+  ctx->inend = ctx->inmem ? ctx->inmem + ctx->inmemlen : 0;
+  if(ctx->reader && !ctx->inblock)
+	ctx->inblock = malloc(INBLOCK);
+
+  if(ctx->outmem)
+  {
+	ctx->outbuf = ctx->outmem;
+	ctx->outsize = ctx->outmemsize ? ctx->outmemsize - 1 : 0;
+  }
+  else
+  {
+	if(!ctx->outblock)
+	  ctx->outblock = malloc(OUTBLOCK);
+	ctx->outbuf = ctx->outblock;
+	ctx->outsize = OUTBLOCK;
+  }
+  ctx->outlen = 0;
+  ctx->outlost = 0;
+  ctx->lineflush = ctx->flushmode == BASIC_FLUSHLINE ||
+	(ctx->flushmode == BASIC_FLUSHAUTO && isterminal(ctx->fpout));
+  ctx->inputflush = isterminal(ctx->fpin);
+
+  if(!ctx->outbuf || (ctx->reader && !ctx->inblock) || allocvariables(ctx) == -1)
+  {
+	writeerror(ctx, "Out of memory\n");
+	flushoutput(ctx, 0);
+	ctx->prog = 0;
+	return 1;
   }
+  
+  answer = execute(ctx);
+  flushoutput(ctx, 0);
 
-  cleanup();
+  cleanup(ctx);
+  ctx->prog = 0;
   
-  return 0;
+  return answer;
 }
 
 /*
-  Sets up all our globals, including the list of lines.
+  choose how the interpreter dispatches instructions.
+  Params: method - BASIC_SWITCH or BASIC_THREADED
+  Returns: the method now in use
+  Notes: BASIC_THREADED is only available with GNU C, otherwise
+		 the switch loop is always used.
+*/
+int basicdispatch(int method)
+{
+#ifdef THREADED
+  if(method == BASIC_SWITCH || method == BASIC_THREADED)
+	dispatchmethod = method;
+#else
+  (void) method;
+#endif
+  return dispatchmethod;
+}
+
+/*
+  Sets up the program, including the list of lines.
   Params: script - the script passed by the user
   Returns: 0 on success, -1 on failure
+  Notes: each line is lexed once here, into the token stream,
+		 and the program compiled. On failure the caller frees
+		 the partly built program.
 */
-static int setup(const char *script)
+static int setup(mb_context *ctx, const char *script)
 {
+  mb_program *prog = ctx->build;
   int i;
+  const char *end;  /* end of last line */
+  char buff[64];
+
+  prog->script = mystrdup(script);
+  if(!prog->script)
+  {
+	writeerror(ctx, "Out of memory\n");
+	return -1;
+  }
+  script = prog->script;
 
-  nlines = mystrcount(script, '\n');
-  lines = malloc(nlines * sizeof(LINE));
-  if(!lines)
+  prog->nlines = mystrcount(script, '\n');
+  prog->lines = malloc(prog->nlines * sizeof(LINE));
+  if(!prog->lines)
   {
-	if(fperr)
-      fprintf(fperr, "Out of memory\n");
+	writeerror(ctx, "Out of memory\n");
 	return -1;
   }
-  for(i=0;i<nlines;i++)
+  for(i=0;i<prog->nlines;i++)
   {
 	if(isdigit(*script))
 	{
-      lines[i].str = script;
-	  lines[i].no = strtol(script, 0, 10);
+	  prog->lines[i].str = script;
+	  prog->lines[i].no = strtol(script, 0, 10);
 	}
 	else
 	{
 	  i--;
-	  nlines--;
+	  prog->nlines--;
 	}
 	script = strchr(script, '\n');
 	script++;
   }
-  if(!nlines)
+  end = script;
+  if(!prog->nlines)
   {
-	if(fperr)
-	  fprintf(fperr, "Can't read program\n");
-    free(lines);
+	writeerror(ctx, "Can't read program\n");
 	return -1;
   }
 
-  for(i=1;i<nlines;i++)
-	if(lines[i].no <= lines[i-1].no)
+  for(i=1;i<prog->nlines;i++)
+	if(prog->lines[i].no <= prog->lines[i-1].no)
+	{
+	  sprintf(buff, "program lines %d and %d not in order\n", 
+		prog->lines[i-1].no, prog->lines[i].no);
+	  writeerror(ctx, buff);
+	  return -1;
+	}
+
+  for(i=0;i<prog->nlines;i++)
+  {
+	prog->lines[i].tok = prog->ntokens;
+	if(tokenize(ctx, prog->lines[i].str, i < prog->nlines - 1 ? prog->lines[i+1].str : end) == -1)
 	{
-	  if(fperr)
-		fprintf(fperr, "program lines %d and %d not in order\n", 
-		  lines[i-1].no, lines[i].no);
-	  free(lines);
+	  writeerror(ctx, "Out of memory\n");
 	  return -1;
 	}
+  }
 
-  nvariables = 0;
-  variables = 0;
+  if(compile(ctx) == -1)
+  {
+	writeerror(ctx, "Out of memory\n");
+	return -1;
+  }
 
-  dimvariables = 0;
-  ndimvariables = 0;
+  if(pairloops(ctx) == -1 || resolvejumps(ctx) == -1)
+	return -1;
 
   return 0;
 }
 
 /*
-  frees all the memory we have allocated
+  lex one line of the script into the token stream.
+  Params: str - start of the line
+		  end - start of the next line
+  Returns: 0 on success, -1 on out of memory
+  Notes: the stream for each line is terminated by EOS.
+		 Lexical errors are stored as ERROR tokens, so they
+		 are only reported if the line is executed.
 */
-static void cleanup(void)
+static int tokenize(mb_context *ctx, const char *str, const char *end)
 {
-  int i;
-  int ii;
-  int size;
-
-  for(i=0;i<nvariables;i++)
-	if(variables[i].sval)
-	  free(variables[i].sval);
-  if(variables)
-	  free(variables);
-  variables = 0;
-  nvariables = 0;
+  int type;
+  int id;
+  int len;
+  double value;
+  const char *close;
 
-  for(i=0;i<ndimvariables;i++)
+  while(1)
   {
-    if(dimvariables[i].type == STRID)
+	while(str < end && isspace(*str))
+	  str++;
+	if(str >= end || *str == 0)
+	  break;
+
+	type = gettoken(str, end, &len, &value);
+	id = -1;
+	switch(type)
 	{
-	  if(dimvariables[i].str)
-	  {
-		size = 1;
-        for(ii=0;ii<dimvariables[i].ndims;ii++)
-		  size *= dimvariables[i].dim[ii];
-	    for(ii=0;ii<size;ii++)
-		  if(dimvariables[i].str[ii])
-		    free(dimvariables[i].str[ii]);
-		free(dimvariables[i].str);
-	  }
+	  case FLTID:
+	  case STRID:
+	  case DIMFLTID:
+	  case DIMSTRID:
+		/* the name includes the $ and ( qualifiers */
+		if(len > 31)
+		{
+		  type = ERROR;
+		  id = ERR_IDTOOLONG;
+		  break;
+		}
+		id = internid(ctx, str, len);
+		if(id == -1)
+		  return -1;
+		break;
+	  case QUOTE:
+		close = mystrend(str, '"');
+		if(!close)
+		{
+		  type = ERROR;
+		  id = ERR_SYNTAX;
+		  break;
+		}
+		len = close - str + 1;
+		break;
+	  case VALUE:
+		/* out of memory converting a long number */
+		if(len == -1)
+		  return -1;
+		break;
+	  case ERROR:
+		id = ERR_SYNTAX;
+		break;
 	}
-	else
-	  if(dimvariables[i].dval)
-		free(dimvariables[i].dval);
+
+	if(addtoken(ctx, type, id, value, str, len) == -1)
+	  return -1;
+	/* the rest of a REM line is not parsed */
+	if(type == ERROR || type == REM)
+	  break;
+	str += len;
   }
 
-  if(dimvariables)
-	free(dimvariables);
- 
-  dimvariables = 0;
-  ndimvariables = 0;
+  return addtoken(ctx, EOS, -1, 0.0, str, 0);
+}
 
-  if(lines)
-	free(lines);
+/*
+  append a token to the token stream.
+  Params: type - the token type
+		  id - identifier handle or error code
+		  value - value of a VALUE token
+		  str - position of the token in the script
+		  len - length of the token
+  Returns: 0 on success, -1 on out of memory
+*/
+static int addtoken(mb_context *ctx, int type, int id, double value, const char *str, int len)
+{
+  mb_program *prog = ctx->build;
+  TOKEN *temp;
+  TOKEN *tk;
 
-  lines = 0;
-  nlines = 0;
-  
+  if(prog->ntokens == prog->maxtokens)
+  {
+	temp = realloc(prog->tokens, (prog->maxtokens + 64) * 2 * sizeof(TOKEN));
+	if(!temp)
+	  return -1;
+	prog->tokens = temp;
+	prog->maxtokens = (prog->maxtokens + 64) * 2;
+  }
+  tk = &prog->tokens[prog->ntokens++];
+  tk->type = type;
+  tk->id = id;
+  tk->len = len;
+  tk->value = value;
+  tk->str = str;
+
+  return 0;
 }
 
 /*
-  error report function.
-  for reporting errors in the user's script.
-  checks the global errorflag.
-  writes to fperr.
-  Params: lineno - the line on which the error occurred
+  get the handle for an identifier, adding it to the list of names.
+  Params: id - the identifier (including $ and ( qualifiers)
+		  len - length of the identifier, at most 31
+  Returns: handle of identifier, -1 on out of memory
+  Notes: the handle is also the variable's slot in variables
+		 or dimvariables.
 */
-static void reporterror(int lineno)
+static int internid(mb_context *ctx, const char *id, int len)
 {
-  if(!fperr)
-	return;
+  mb_program *prog = ctx->build;
+  char (*temp)[32];
+  unsigned h;
+
+  if(prog->nids * 2 >= prog->idhashsize)
+	if(rehashids(ctx) == -1)
+	  return -1;
 
-  switch(errorflag)
+  h = hashid(id, len) & (prog->idhashsize - 1);
+  while(prog->idhash[h] != -1)
   {
-    case ERR_CLEAR:
-	  assert(0);
-	  break;
-	case ERR_SYNTAX:
-	  fprintf(fperr, "Syntax error line %d\n", lineno);
-	  break;
-	case ERR_OUTOFMEMORY:
-	  fprintf(fperr, "Out of memory line %d\n", lineno);
-	  break;
-	case ERR_IDTOOLONG:
-	  fprintf(fperr, "Identifier too long line %d\n", lineno);
-	  break;
-	case ERR_NOSUCHVARIABLE:
-	  fprintf(fperr, "No such variable line %d\n", lineno);
-	  break;
-	case ERR_BADSUBSCRIPT:
-	  fprintf(fperr, "Bad subscript line %d\n", lineno);
-	  break;
-	case ERR_TOOMANYDIMS:
-	  fprintf(fperr, "Too many dimensions line %d\n", lineno);
-	  break;
-	case ERR_TOOMANYINITS:
-	  fprintf(fperr, "Too many initialisers line %d\n", lineno);
-	  break;
-	case ERR_BADTYPE:
-	  fprintf(fperr, "Illegal type line %d\n", lineno);
-	  break;
-	case ERR_TOOMANYFORS:
-	  fprintf(fperr, "Too many nested fors line %d\n", lineno);
-	  break;
-	case ERR_NONEXT:
-	  fprintf(fperr, "For without matching next line %d\n", lineno);
-	  break;
+	if(!memcmp(prog->idnames[prog->idhash[h]], id, len) && 
+	  prog->idnames[prog->idhash[h]][len] == 0)
+	  return prog->idhash[h];
+	h = (h + 1) & (prog->idhashsize - 1);
+  }
+
+  if(prog->nids == prog->maxids)
+  {
+	temp = realloc(prog->idnames, (prog->maxids + 16) * 2 * sizeof(prog->idnames[0]));
+	if(!temp)
+	  return -1;
+	prog->idnames = temp;
+	prog->maxids = (prog->maxids + 16) * 2;
+  }
+  memcpy(prog->idnames[prog->nids], id, len);
+  prog->idnames[prog->nids][len] = 0;
+  prog->idhash[h] = prog->nids;
+
+  return prog->nids++;
+}
+
+/*
+  double the size of the identifier hash table.
+  Returns: 0 on success, -1 on out of memory
+*/
+static int rehashids(mb_context *ctx)
+{
+  mb_program *prog = ctx->build;
+  int *temp;
+  int size;
+  int i;
+  unsigned h;
+
+  size = prog->idhashsize ? prog->idhashsize * 2 : 64;
+  temp = malloc(size * sizeof(int));
+  if(!temp)
+	return -1;
+  for(i=0;i<size;i++)
+	temp[i] = -1;
+  for(i=0;i<prog->nids;i++)
+  {
+	h = hashid(prog->idnames[i], strlen(prog->idnames[i])) & (size - 1);
+	while(temp[h] != -1)
+	  h = (h + 1) & (size - 1);
+	temp[h] = i;
+  }
+
+  if(prog->idhash)
+	free(prog->idhash);
+  prog->idhash = temp;
+  prog->idhashsize = size;
+
+  return 0;
+}
+
+/*
+  hash function for identifiers and string literals
+  Params: id - the characters
+		  len - number of characters
+*/
+static unsigned hashid(const char *id, int len)
+{
+  unsigned answer = 0;
+
+  while(len--)
+	answer = answer * 31 + (unsigned char) *id++;
+
+  return answer ^ (answer >> 16);
+}
+
+/*
+  allocate a slot for every identifier in the program.
+  Returns: 0 on success, -1 on out of memory
+  Notes: scalars are created when first assigned, arrays by DIM.
+*/
+static int allocvariables(mb_context *ctx)
+{
+  const mb_program *prog = ctx->prog;
+  int i;
+
+  ctx->variables = runalloc(ctx, (prog->nids + 1) * sizeof(VARIABLE));
+  ctx->dimvariables = runalloc(ctx, (prog->nids + 1) * sizeof(DIMVAR));
+  if(!ctx->variables || !ctx->dimvariables)
+  {
+	if(ctx->variables)
+	  runfree(ctx, ctx->variables);
+	if(ctx->dimvariables)
+	  runfree(ctx, ctx->dimvariables);
+	ctx->variables = 0;
+	ctx->dimvariables = 0;
+	return -1;
+  }
+
+  for(i=0;i<prog->nids;i++)
+  {
+	ctx->variables[i].defined = 0;
+	ctx->variables[i].dval = 0;
+	ctx->variables[i].sval.len = 0;
+	ctx->variables[i].sval.u.small[0] = 0;
+	ctx->variables[i].inrange = 0;
+	ctx->variables[i].dimstamp = 0;
+
+	ctx->dimvariables[i].type = strchr(prog->idnames[i], '$') ? STRID : FLTID;
+	ctx->dimvariables[i].ndims = 0;
+	ctx->dimvariables[i].size = 0;
+	ctx->dimvariables[i].dval = 0;
+	ctx->dimvariables[i].str = 0;
+  }
+
+  return 0;
+}
+
+/*
+  frees all the memory allocated by a run
+  Notes: with an arena the blocks aren't visited, the arena is
+		 just reset.
+*/
+static void cleanup(mb_context *ctx)
+{
+  int i;
+  int ii;
+
+  if(ctx->usearena)
+  {
+	resetarena(ctx);
+	ctx->variables = 0;
+	ctx->dimvariables = 0;
+	return;
+  }
+
+  if(ctx->variables)
+  {
+	for(i=0;i<ctx->prog->nids;i++)
+	  if(ctx->variables[i].sval.len > SMALLSTRING)
+		dropstring(ctx, ctx->variables[i].sval.u.big);
+	free(ctx->variables);
+  }
+  ctx->variables = 0;
+
+  for(i=0;ctx->dimvariables && i<ctx->prog->nids;i++)
+  {
+	if(ctx->dimvariables[i].type == STRID)
+	{
+	  if(ctx->dimvariables[i].str)
+	  {
+		for(ii=0;ii<ctx->dimvariables[i].size;ii++)
+		  if(ctx->dimvariables[i].str[ii].len > SMALLSTRING)
+			dropstring(ctx, ctx->dimvariables[i].str[ii].u.big);
+		free(ctx->dimvariables[i].str);
+	  }
+	}
+	else
+	  if(ctx->dimvariables[i].dval)
+		free(ctx->dimvariables[i].dval);
+  }
+
+  if(ctx->dimvariables)
+	free(ctx->dimvariables);
+  ctx->dimvariables = 0;
+}
+
+/*
+  error report function.
+  for reporting errors in the user's script.
+  checks the global errorflag.
+  writes to fperr, or the error writer.
+  Params: lineno - the line on which the error occurred
+*/
+static void reporterror(mb_context *ctx, int lineno)
+{
+  const char *fmt = "ERROR line %d\n";
+  char buff[64];
+
+  switch(ctx->errorflag)
+  {
+    case ERR_CLEAR:
+	  assert(0);
+	  break;
+	case ERR_SYNTAX:
+	  fmt = "Syntax error line %d\n";
+	  break;
+	case ERR_OUTOFMEMORY:
+	  fmt = "Out of memory line %d\n";
+	  break;
+	case ERR_IDTOOLONG:
+	  fmt = "Identifier too long line %d\n";
+	  break;
+	case ERR_NOSUCHVARIABLE:
+	  fmt = "No such variable line %d\n";
+	  break;
+	case ERR_BADSUBSCRIPT:
+	  fmt = "Bad subscript line %d\n";
+	  break;
+	case ERR_TOOMANYDIMS:
+	  fmt = "Too many dimensions line %d\n";
+	  break;
+	case ERR_TOOMANYINITS:
+	  fmt = "Too many initialisers line %d\n";
+	  break;
+	case ERR_BADTYPE:
+	  fmt = "Illegal type line %d\n";
+	  break;
+	case ERR_TOOMANYFORS:
+	  fmt = "Too many nested fors line %d\n";
+	  break;
+	case ERR_NONEXT:
+	  fmt = "For without matching next line %d\n";
+	  break;
 	case ERR_NOFOR:
-	  fprintf(fperr, "Next without matching for line %d\n", lineno);
+	  fmt = "Next without matching for line %d\n";
 	  break;
 	case ERR_DIVIDEBYZERO:
-	  fprintf(fperr, "Divide by zero lne %d\n", lineno);
+	  fmt = "Divide by zero lne %d\n";
 	  break;
 	case ERR_NEGLOG:
-	  fprintf(fperr, "Negative logarithm line %d\n", lineno);
+	  fmt = "Negative logarithm line %d\n";
 	  break;
 	case ERR_NEGSQRT:
-	  fprintf(fperr, "Negative square root line %d\n", lineno);
+	  fmt = "Negative square root line %d\n";
 	  break;
 	case ERR_EOF:
-	  fprintf(fperr, "End of input file %d\n", lineno);
+	  fmt = "End of input file %d\n";
 	  break;
 	case ERR_ILLEGALOFFSET:
-	  fprintf(fperr, "Illegal offset line %d\n", lineno);
+	  fmt = "Illegal offset line %d\n";
 	  break;
 	case ERR_TYPEMISMATCH:
-	  fprintf(fperr, "Type mismatch line %d\n", lineno);
+	  fmt = "Type mismatch line %d\n";
+	  break;
+	case ERR_NOSUCHLINE:
+	  fmt = "No such line line %d\n";
 	  break;
 	default:
-	  fprintf(fperr, "ERROR line %d\n", lineno);
+	  fmt = "ERROR line %d\n";
 	  break;
   }
+  sprintf(buff, fmt, lineno);
+  writeerror(ctx, buff);
 }
 
 /*
@@ -475,28 +1576,28 @@ static void reporterror(int lineno)
   Params: no - line number to find
   Returns: index of the line, or -1 on fail.
 */
-static int findline(int no)
+static int findline(const mb_program *prog, int no)
 {
   int high;
   int low;
   int mid;
 
   low = 0;
-  high = nlines-1;
+  high = prog->nlines-1;
   while(high > low + 1)
   {
     mid = (high + low)/2;
-	if(lines[mid].no == no)
+	if(prog->lines[mid].no == no)
 	  return mid;
-	if(lines[mid].no > no)
+	if(prog->lines[mid].no > no)
 	  high = mid;
 	else
 	  low = mid;
   }
 
-  if(lines[low].no == no)
+  if(prog->lines[low].no == no)
 	mid = low;
-  else if(lines[high].no == no)
+  else if(prog->lines[high].no == no)
 	mid = high;
   else
 	mid = -1;
@@ -505,437 +1606,1157 @@ static int findline(int no)
 }
 
 /*
-  Parse a line. High level parse function
+  find the line containing an instruction
+  Params: pc - the instruction
+  Returns: index of the line
 */
-static int line(void)
+static int findcodeline(const mb_program *prog, const INSTR *pc)
 {
+  int high;
+  int low;
+  int mid;
+  int pos;
+
+  pos = pc - prog->code;
+  low = 0;
+  high = prog->nlines - 1;
+  while(high > low)
+  {
+	mid = (high + low + 1)/2;
+	if(prog->lines[mid].code > pos)
+	  high = mid - 1;
+	else
+	  low = mid;
+  }
+
+  return low;
+}
+
+/*
+  compile the program into code.
+  Returns: 0 on success, -1 on out of memory
+  Notes: a line which fails to compile is replaced by an
+		 OP_ERROR, so errors are only reported if it is executed.
+*/
+static int compile(mb_context *ctx)
+{
+  mb_program *prog = ctx->build;
+  int i;
+  int j;
+  int err;
+  int firstcheck;
+
+  prog->code = 0;
+  prog->ncode = 0;
+  prog->maxcode = 0;
+  prog->maxddepth = 0;
+  prog->maxsdepth = 0;
+  ctx->nforcode = 0;
+  prog->checks = 0;
+  prog->nchecks = 0;
+  prog->maxchecks = 0;
+
+  for(i=0;i<prog->nlines;i++)
+  {
+	prog->lines[i].code = prog->ncode;
+	firstcheck = prog->nchecks;
+	ctx->curtok = &prog->tokens[prog->lines[i].tok];
+	ctx->token = ctx->curtok->type;
+	ctx->errorflag = 0;
+	ctx->target = -1;
+	ctx->ddepth = 0;
+	ctx->sdepth = 0;
+
+	line(ctx);
+
+	if(ctx->errorflag && ctx->errorflag != ERR_OUTOFMEMORY)
+	{
+	  err = ctx->errorflag;
+	  ctx->errorflag = 0;
+	  prog->ncode = prog->lines[i].code;
+	  while(ctx->nforcode && ctx->forcode[ctx->nforcode-1] >= prog->ncode)
+		ctx->nforcode--;
+	  for(j=0;j<ctx->nforcode;j++)
+		while(prog->code[ctx->forcode[j]].n >= firstcheck)
+		  prog->code[ctx->forcode[j]].n = prog->checks[prog->code[ctx->forcode[j]].n].next;
+	  prog->nchecks = firstcheck;
+	  emit(ctx, OP_ERROR, err, 0);
+	}
+	if(ctx->errorflag)
+	  return -1;
+  }
+
+  emit(ctx, OP_END, 0, 0);
+  if(ctx->errorflag)
+	return -1;
+
+  return 0;
+}
+
+/*
+  pair each FOR with the first NEXT of the same variable after it.
+  Returns: 0 on success, -1 on fail
+  Notes: loops must nest. A FOR left without a NEXT, or a NEXT with
+		 no FOR before it, is reported here, before the program runs.
+		 A loop may have further NEXTs, reached by GOTO.
+		 A FOR or NEXT line that failed to compile still pairs by the
+		 variable it names, so its own error is reported when it runs
+		 instead of a misleading one about its partner.
+*/
+static int pairloops(mb_context *ctx)
+{
+  mb_program *prog = ctx->build;
+  int *open;
+  int *openid;
+  char *seen;
+  int nopen = 0;
+  int i;
+  int ii;
+  int id;
+  int first;
+  int last;
+
+  open = malloc(prog->nlines * sizeof(int));
+  openid = malloc(prog->nlines * sizeof(int));
+  seen = malloc(prog->nids + 1);
+  if(!open || !openid || !seen)
+  {
+	if(open)
+	  free(open);
+	if(openid)
+	  free(openid);
+	if(seen)
+	  free(seen);
+	writeerror(ctx, "Out of memory\n");
+	return -1;
+  }
+  memset(seen, 0, prog->nids + 1);
+
+  for(i=0;i<prog->nlines;i++)
+  {
+	first = prog->lines[i].code;
+	last = (i < prog->nlines - 1 ? prog->lines[i+1].code : prog->ncode - 1) - 1;
+	if(last < first)
+	  continue;
+	if(prog->code[last].op == OP_FOR)
+	{
+	  open[nopen] = last;
+	  openid[nopen++] = prog->code[last].arg;
+	}
+	else if((id = errorloopvar(prog, i, FOR)) != -1)
+	{
+	  /* never entered, so there is nothing to link */
+	  open[nopen] = -1;
+	  openid[nopen++] = id;
+	}
+	else if(prog->code[first].op == OP_NEXT ||
+	  (id = errorloopvar(prog, i, NEXT)) != -1)
+	{
+	  if(prog->code[first].op == OP_NEXT)
+		id = prog->code[first].arg;
+	  for(ii=nopen-1;ii>=0;ii--)
+		if(openid[ii] == id)
+		  break;
+	  if(ii == -1 && seen[id])
+		continue;
+	  if(ii == -1)
+	  {
+		/* the error on the NEXT line itself is reported when it runs */
+		if(prog->code[first].op != OP_NEXT)
+		  continue;
+		ctx->errorflag = ERR_NOFOR;
+		reporterror(ctx, prog->lines[i].no);
+		break;
+	  }
+	  /* an inner loop is still open, reported below */
+	  if(ii != nopen - 1)
+		break;
+	  if(open[ii] != -1)
+		prog->code[open[ii]].link = last + 1;
+	  seen[id] = 1;
+	  nopen--;
+	}
+  }
+
+  if(!ctx->errorflag && nopen)
+  {
+	ctx->errorflag = ERR_NONEXT;
+	reporterror(ctx, prog->lines[findcodeline(ctx->build, prog->code + open[nopen-1])].no);
+  }
+
+  free(open);
+  free(openid);
+  free(seen);
+  if(ctx->errorflag)
+  {
+	ctx->errorflag = 0;
+	return -1;
+  }
+
+  return 0;
+}
+
+/*
+  get the loop variable of a FOR or NEXT line that failed to compile.
+  Params: prog - the program
+		  i - index of the line
+		  keyword - FOR or NEXT
+  Returns: identifier handle of the variable, -1 if the line compiled,
+		   is not that statement or names no numeric variable.
+*/
+static int errorloopvar(mb_program *prog, int i, int keyword)
+{
+  TOKEN *tok = &prog->tokens[prog->lines[i].tok];
+  int last;
+
+  last = (i < prog->nlines - 1 ? prog->lines[i+1].code : prog->ncode - 1) - 1;
+  if(last != prog->lines[i].code || prog->code[last].op != OP_ERROR)
+	return -1;
+  /* the stream ends with EOS, so stopping at a mismatch stays inside it */
+  if(tok[0].type != VALUE || tok[1].type != keyword || tok[2].type != FLTID)
+	return -1;
+
+  return tok[2].id;
+}
+
+/*
+  point direct jumps at their target instructions.
+  Returns: 0 on success, -1 on fail
+  Notes: a jump to a line that does not exist is reported here,
+		 before the program runs. Also builds the table used by
+		 computed jumps, unless the line numbers are too sparse.
+*/
+static int resolvejumps(mb_context *ctx)
+{
+  mb_program *prog = ctx->build;
+  int i;
+  int idx;
+  double x;
+  char buff[64];
+
+  for(i=0;i<prog->ncode;i++)
+  {
+	if(prog->code[i].op != OP_JUMP && prog->code[i].op != OP_JUMPIF)
+	  continue;
+	x = prog->code[i].val;
+	idx = (x > INT_MIN && x < INT_MAX) ? findline(ctx->build, (int) x) : -1;
+	if(idx == -1)
+	{
+	  sprintf(buff, "No such line %d line %d\n", 
+		(x > INT_MIN && x < INT_MAX) ? (int) x : 0, 
+		prog->lines[findcodeline(ctx->build, prog->code + i)].no);
+	  writeerror(ctx, buff);
+	  return -1;
+	}
+	prog->code[i].arg = prog->lines[idx].code;
+  }
+
+  prog->minlineno = prog->lines[0].no;
+  if(prog->lines[prog->nlines-1].no - prog->minlineno < MAXLINESPAN(prog->nlines))
+  {
+	prog->nlinecode = prog->lines[prog->nlines-1].no - prog->minlineno + 1;
+	prog->linecode = malloc(prog->nlinecode * sizeof(int));
+	if(!prog->linecode)
+	{
+	  writeerror(ctx, "Out of memory\n");
+	  return -1;
+	}
+	for(i=0;i<prog->nlinecode;i++)
+	  prog->linecode[i] = -1;
+	for(i=0;i<prog->nlines;i++)
+	  prog->linecode[prog->lines[i].no - prog->minlineno] = prog->lines[i].code;
+  }
+
+  return 0;
+}
+
+/*
+  run the compiled program.
+  Returns: 0 on success, 1 on error.
+  Notes: each instruction ends with NEXTOP. With computed goto
+		 this jumps straight to the next instruction's label, or
+		 back to the switch if that method has been chosen.
+*/
+
+#ifdef THREADED
+#define CASE(op) case op: L_##op
+#define NEXTOP ip = pc++; goto *jump[ip->op]
+#else
+#define CASE(op) case op
+#define NEXTOP continue
+#endif
+
+static int execute(mb_context *ctx)
+{
+  const mb_program *prog = ctx->prog;
+#ifdef THREADED
+  static void *const threaded[NOPS] =
+  {
+	&&L_OP_END, &&L_OP_ERROR, &&L_OP_PUSHNUM, &&L_OP_LOADVAR,
+	&&L_OP_LOADDIM, &&L_OP_STOREVAR, &&L_OP_STOREDIM, &&L_OP_ADD,
+	&&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD, &&L_OP_NEG,
+	&&L_OP_FACT, &&L_OP_SIN, &&L_OP_COS, &&L_OP_TAN, &&L_OP_LN,
+	&&L_OP_POW, &&L_OP_SQRT, &&L_OP_ABS, &&L_OP_ASIN, &&L_OP_ACOS,
+	&&L_OP_ATAN, &&L_OP_INT, &&L_OP_RND, &&L_OP_CMP, &&L_OP_AND,
+	&&L_OP_OR, &&L_OP_PUSHLIT, &&L_OP_LOADSTR, &&L_OP_LOADDIMSTR,
+	&&L_OP_STORESTR, &&L_OP_STOREDIMSTR, &&L_OP_CONCAT, &&L_OP_SCMP,
+	&&L_OP_LEN, &&L_OP_ASCII, &&L_OP_VAL, &&L_OP_CHR, &&L_OP_STR,
+	&&L_OP_LEFT, &&L_OP_RIGHT, &&L_OP_MID, &&L_OP_STRING,
+	&&L_OP_PRINTNUM, &&L_OP_PRINTSTR, &&L_OP_PRINTCHAR,
+	&&L_OP_INPUTNUM, &&L_OP_INPUTSTR, &&L_OP_DIM, &&L_OP_DIMINIT,
+	&&L_OP_DIMINITSTR, &&L_OP_GOTO, &&L_OP_IF, &&L_OP_FOR, &&L_OP_NEXT,
+	&&L_OP_JUMP, &&L_OP_JUMPIF, &&L_OP_LOADDIMV, &&L_OP_STOREDIMV,
+	&&L_OP_APPENDSTR
+  };
+  void *switched[NOPS];
+  void *const *jump;
+#endif
+  const INSTR *pc;
+  const INSTR *ip;
+  double *dstack;
+  STRVAL *sstack;
+  double *dsp;
+  STRVAL *ssp;
+  VARIABLE *var;
+  FORLOOP *loop;
+  double *dptr;
+  STRSLOT *sptr;
+  STRING *str;
+  char buff[32];
+  double x;
+  int i;
   int answer = 0;
 
-  match(VALUE);
+  dstack = runalloc(ctx, (prog->maxddepth + 1) * sizeof(double));
+  sstack = runalloc(ctx, (prog->maxsdepth + 1) * sizeof(STRVAL));
+  if(!dstack || !sstack)
+  {
+	writeerror(ctx, "Out of memory\n");
+	runfree(ctx, dstack);
+	runfree(ctx, sstack);
+	return 1;
+  }
+
+  dsp = dstack;
+  ssp = sstack;
+  ctx->nfors = 0;
+  ctx->ndimops = 0;
+  ctx->errorflag = 0;
+  pc = prog->code;
+
+#ifdef THREADED
+  for(i=0;i<NOPS;i++)
+	switched[i] = &&dispatch;
+  jump = (dispatchmethod == BASIC_THREADED) ? threaded : switched;
+#endif
 
-  switch(token)
+  while(1)
+  {
+	ip = pc++;
+#ifdef THREADED
+dispatch:
+#endif
+	switch(ip->op)
+	{
+	  CASE(OP_END):
+		goto done;
+	  CASE(OP_ERROR):
+		seterror(ctx, ip->arg);
+		goto error;
+
+	  CASE(OP_PUSHNUM):
+		*dsp++ = ip->val;
+		NEXTOP;
+	  CASE(OP_LOADVAR):
+		var = &ctx->variables[ip->arg];
+		if(!var->defined)
+		{
+		  if(!ip->n)
+		  {
+			seterror(ctx, ERR_NOSUCHVARIABLE);
+			goto error;
+		  }
+		  var->defined = 1;
+		}
+		*dsp++ = var->dval;
+		NEXTOP;
+	  CASE(OP_LOADDIM):
+		dsp -= ip->n;
+		dptr = getelement(ctx, ip->arg, ip->n, dsp);
+		if(!dptr)
+		  goto error;
+		*dsp++ = *dptr;
+		NEXTOP;
+	  CASE(OP_STOREVAR):
+		var = &ctx->variables[ip->arg];
+		var->defined = 1;
+		var->inrange = 0;
+		var->dval = *--dsp;
+		NEXTOP;
+	  CASE(OP_STOREDIM):
+		x = *--dsp;
+		dsp -= ip->n;
+		dptr = getelement(ctx, ip->arg, ip->n, dsp);
+		if(!dptr)
+		  goto error;
+		*dptr = x;
+		NEXTOP;
+
+	  CASE(OP_ADD):
+		dsp--;
+		dsp[-1] += dsp[0];
+		NEXTOP;
+	  CASE(OP_SUB):
+		dsp--;
+		dsp[-1] -= dsp[0];
+		NEXTOP;
+	  CASE(OP_MUL):
+		dsp--;
+		dsp[-1] *= dsp[0];
+		NEXTOP;
+	  CASE(OP_DIV):
+		dsp--;
+		if(dsp[0] == 0.0)
+		{
+		  seterror(ctx, ERR_DIVIDEBYZERO);
+		  goto error;
+		}
+		dsp[-1] /= dsp[0];
+		NEXTOP;
+	  CASE(OP_MOD):
+		dsp--;
+		dsp[-1] = fmod(dsp[-1], dsp[0]);
+		NEXTOP;
+	  CASE(OP_NEG):
+		dsp[-1] = -dsp[-1];
+		NEXTOP;
+	  CASE(OP_FACT):
+		dsp[-1] = factorial(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_SIN):
+		dsp[-1] = sin(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_COS):
+		dsp[-1] = cos(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_TAN):
+		dsp[-1] = tan(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_LN):
+		if(dsp[-1] <= 0)
+		{
+		  seterror(ctx, ERR_NEGLOG);
+		  goto error;
+		}
+		dsp[-1] = log(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_POW):
+		dsp--;
+		dsp[-1] = pow(dsp[-1], dsp[0]);
+		NEXTOP;
+	  CASE(OP_SQRT):
+		if(dsp[-1] < 0.0)
+		{
+		  seterror(ctx, ERR_NEGSQRT);
+		  goto error;
+		}
+		dsp[-1] = sqrt(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_ABS):
+		dsp[-1] = fabs(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_ASIN):
+		dsp[-1] = asin(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_ACOS):
+		dsp[-1] = acos(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_ATAN):
+		dsp[-1] = atan(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_INT):
+		dsp[-1] = floor(dsp[-1]);
+		NEXTOP;
+	  CASE(OP_RND):
+		dsp[-1] = rnd(ctx, dsp[-1]);
+		NEXTOP;
+	  CASE(OP_CMP):
+		dsp--;
+		dsp[-1] = numcompare(dsp[-1], dsp[0], ip->arg);
+		NEXTOP;
+	  CASE(OP_AND):
+		dsp--;
+		dsp[-1] = (dsp[-1] != 0.0 && dsp[0] != 0.0) ? 1 : 0;
+		NEXTOP;
+	  CASE(OP_OR):
+		dsp--;
+		dsp[-1] = (dsp[-1] != 0.0 || dsp[0] != 0.0) ? 1 : 0;
+		NEXTOP;
+
+	  CASE(OP_PUSHLIT):
+		ssp->str = prog->pool + ip->arg;
+		ssp->len = ip->n;
+		ssp->mem = 0;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_LOADSTR):
+		var = &ctx->variables[ip->arg];
+		if(!var->defined)
+		{
+		  if(!ip->n)
+		  {
+			seterror(ctx, ERR_NOSUCHVARIABLE);
+			goto error;
+		  }
+		  var->defined = 1;
+		}
+		ssp->str = SLOTCHARS(&var->sval);
+		ssp->len = var->sval.len;
+		ssp->mem = var->sval.len > SMALLSTRING ? var->sval.u.big : 0;
+		if(ssp->mem)
+		  ssp->mem->refs++;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_LOADDIMSTR):
+		dsp -= ip->n;
+		sptr = getelement(ctx, ip->arg, ip->n, dsp);
+		if(!sptr)
+		  goto error;
+		ssp->str = SLOTCHARS(sptr);
+		ssp->len = sptr->len;
+		ssp->mem = sptr->len > SMALLSTRING ? sptr->u.big : 0;
+		if(ssp->mem)
+		  ssp->mem->refs++;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_STORESTR):
+		var = &ctx->variables[ip->arg];
+		var->defined = 1;
+		if(storestring(ctx, &var->sval, --ssp) == -1)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_STOREDIMSTR):
+		dsp -= ip->n;
+		sptr = getelement(ctx, ip->arg, ip->n, dsp);
+		if(!sptr)
+		  goto error;
+		if(storestring(ctx, sptr, --ssp) == -1)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_APPENDSTR):
+		var = &ctx->variables[ip->arg];
+		var->defined = 1;
+		if(appendstring(ctx, &var->sval, ssp - ip->n, ip->n) == -1)
+		  goto error;
+		for(i=1;i<=ip->n;i++)
+		  dropstring(ctx, ssp[-i].mem);
+		ssp -= ip->n;
+		NEXTOP;
+	  CASE(OP_CONCAT):
+		str = runconcat(ctx, ssp - ip->n, ip->n);
+		if(!str)
+		{
+		  seterror(ctx, ERR_OUTOFMEMORY);
+		  goto error;
+		}
+		for(i=1;i<=ip->n;i++)
+		  dropstring(ctx, ssp[-i].mem);
+		ssp -= ip->n;
+		ssp->str = str->str;
+		ssp->len = str->len;
+		ssp->mem = str;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_SCMP):
+		ssp -= 2;
+		*dsp++ = strcompare(&ssp[0], &ssp[1], ip->arg);
+		dropstring(ctx, ssp[0].mem);
+		dropstring(ctx, ssp[1].mem);
+		NEXTOP;
+	  CASE(OP_LEN):
+		ssp--;
+		*dsp++ = ssp->len;
+		dropstring(ctx, ssp->mem);
+		NEXTOP;
+	  CASE(OP_ASCII):
+		ssp--;
+		*dsp++ = ssp->len ? ssp->str[0] : 0;
+		dropstring(ctx, ssp->mem);
+		NEXTOP;
+	  CASE(OP_VAL):
+		ssp--;
+		x = valstring(ctx, ssp);
+		dropstring(ctx, ssp->mem);
+		if(ctx->errorflag)
+		  goto error;
+		*dsp++ = x;
+		NEXTOP;
+	  CASE(OP_CHR):
+		str = chrstring(ctx, *--dsp);
+		if(!str)
+		  goto error;
+		ssp->str = str->str;
+		ssp->len = str->len;
+		ssp->mem = str;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_STR):
+		str = strstring(ctx, *--dsp);
+		if(!str)
+		  goto error;
+		ssp->str = str->str;
+		ssp->len = str->len;
+		ssp->mem = str;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_LEFT):
+		leftstring(ctx, &ssp[-1], *--dsp);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_RIGHT):
+		rightstring(ctx, &ssp[-1], *--dsp);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_MID):
+		dsp -= 2;
+		midstring(ctx, &ssp[-1], dsp[0], dsp[1]);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_STRING):
+		stringstring(ctx, *--dsp, &ssp[-1]);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+
+	  CASE(OP_PRINTNUM):
+		if(ctx->outsize - ctx->outlen >= sizeof(buff))
+		  ctx->outlen += formatnumber(ctx->outbuf + ctx->outlen, *--dsp);
+		else
+		  writeoutput(ctx, buff, formatnumber(buff, *--dsp));
+		NEXTOP;
+	  CASE(OP_PRINTSTR):
+		ssp--;
+		writeoutput(ctx, ssp->str, ssp->len);
+		dropstring(ctx, ssp->mem);
+		NEXTOP;
+	  CASE(OP_PRINTCHAR):
+		if(ctx->outlen < ctx->outsize)
+		  ctx->outbuf[ctx->outlen++] = (char) ip->arg;
+		else
+		{
+		  buff[0] = (char) ip->arg;
+		  writeoutput(ctx, buff, 1);
+		}
+		if(ip->arg == '\n' && ctx->lineflush)
+		  flushoutput(ctx, 1);
+		NEXTOP;
+	  CASE(OP_INPUTNUM):
+		if(inputnumber(ctx, dsp) == -1)
+		  goto error;
+		dsp++;
+		NEXTOP;
+	  CASE(OP_INPUTSTR):
+		if(inputstring(ctx, ssp) == -1)
+		  goto error;
+		ssp++;
+		NEXTOP;
+	  CASE(OP_DIM):
+		dsp -= ip->n;
+		ctx->ndimops++;
+		if(!dimarray(ctx, ip->arg, ip->n, dsp))
+		  goto error;
+		NEXTOP;
+	  CASE(OP_DIMINIT):
+		initarray(ctx, ip->arg, ip->n, *--dsp, 0);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_DIMINITSTR):
+		initarray(ctx, ip->arg, ip->n, 0.0, --ssp);
+		if(ctx->errorflag)
+		  goto error;
+		NEXTOP;
+
+	  CASE(OP_JUMP):
+		pc = prog->code + ip->arg;
+		NEXTOP;
+	  CASE(OP_JUMPIF):
+		if(*--dsp != 0.0)
+		  pc = prog->code + ip->arg;
+		NEXTOP;
+	  CASE(OP_GOTO):
+		pc = jumpline(ctx, *--dsp);
+		if(!pc)
+		  goto error;
+		NEXTOP;
+	  CASE(OP_IF):
+		dsp -= 2;
+		if(dsp[0] != 0.0)
+		{
+		  pc = jumpline(ctx, dsp[1]);
+		  if(!pc)
+			goto error;
+		}
+		NEXTOP;
+	  CASE(OP_FOR):
+		dsp -= 3;
+		var = &ctx->variables[ip->arg];
+		var->defined = 1;
+		var->inrange = 0;
+		var->dval = dsp[0];
+		if(ctx->nfors > 31)
+		{
+		  seterror(ctx, ERR_TOOMANYFORS);
+		  goto error;
+		}
+		if((dsp[2] < 0 && dsp[0] < dsp[1]) || (dsp[2] > 0 && dsp[0] > dsp[1]))
+		  pc = prog->code + ip->link;
+		else
+		{
+		  ctx->forstack[ctx->nfors].next = pc;
+		  ctx->forstack[ctx->nfors].toval = dsp[1];
+		  ctx->forstack[ctx->nfors].step = dsp[2];
+		  ctx->nfors++;
+		  if(ip->n != -1 && checkrange(ctx, ip, dsp[0], dsp[1], dsp[2]))
+		  {
+			var->inrange = ip - prog->code;
+			var->dimstamp = ctx->ndimops;
+		  }
+		}
+		NEXTOP;
+	  CASE(OP_NEXT):
+		if(!ctx->nfors)
+		{
+		  seterror(ctx, ERR_NOFOR);
+		  goto error;
+		}
+		var = &ctx->variables[ip->arg];
+		var->defined = 1;
+		loop = &ctx->forstack[ctx->nfors-1];
+		if(var->inrange != loop->next - 1 - prog->code)
+		  var->inrange = 0;
+		var->dval += loop->step;
+		if( (loop->step < 0 && var->dval < loop->toval) ||
+			(loop->step > 0 && var->dval > loop->toval) )
+		{
+		  ctx->nfors--;
+		  var->inrange = 0;
+		}
+		else
+		  pc = loop->next;
+		NEXTOP;
+	  CASE(OP_LOADDIMV):
+		var = &ctx->variables[prog->code[ip->n].arg];
+		if(var->inrange == ip->n && var->dimstamp == ctx->ndimops)
+		  *dsp++ = ctx->dimvariables[ip->arg].dval[(int) var->dval - 1];
+		else
+		{
+		  if(!var->defined)
+		  {
+			seterror(ctx, ERR_NOSUCHVARIABLE);
+			goto error;
+		  }
+		  dptr = getelement(ctx, ip->arg, 1, &var->dval);
+		  if(!dptr)
+			goto error;
+		  *dsp++ = *dptr;
+		}
+		NEXTOP;
+	  CASE(OP_STOREDIMV):
+		var = &ctx->variables[prog->code[ip->n].arg];
+		if(var->inrange == ip->n && var->dimstamp == ctx->ndimops)
+		  ctx->dimvariables[ip->arg].dval[(int) var->dval - 1] = *--dsp;
+		else
+		{
+		  if(!var->defined)
+		  {
+			seterror(ctx, ERR_NOSUCHVARIABLE);
+			goto error;
+		  }
+		  dptr = getelement(ctx, ip->arg, 1, &var->dval);
+		  if(!dptr)
+			goto error;
+		  *dptr = *--dsp;
+		}
+		NEXTOP;
+
+	  default:
+		assert(0);
+		NEXTOP;
+	}
+  }
+
+error:
+  flushoutput(ctx, 0);
+  reporterror(ctx, prog->lines[findcodeline(ctx->prog, ip)].no);
+  answer = 1;
+done:
+  while(ssp > sstack)
+	dropstring(ctx, (--ssp)->mem);
+  runfree(ctx, dstack);
+  runfree(ctx, sstack);
+
+  return answer;
+}
+
+/*
+  find the code for a computed GOTO target
+  Params: x - the line number to jump to
+  Returns: the line's first instruction, 0 if not found (error set)
+  Notes: uses the dense table if resolvejumps() built one.
+*/
+static const INSTR *jumpline(mb_context *ctx, double x)
+{
+  const mb_program *prog = ctx->prog;
+  int no;
+  int idx;
+
+  no = (x > INT_MIN && x < INT_MAX) ? (int) x : INT_MIN;
+  if(prog->linecode)
+  {
+	if(no >= prog->minlineno && no - prog->minlineno < prog->nlinecode && 
+	  prog->linecode[no - prog->minlineno] != -1)
+	  return prog->code + prog->linecode[no - prog->minlineno];
+  }
+  else
+  {
+	idx = findline(ctx->prog, no);
+	if(idx != -1)
+	  return prog->code + prog->lines[idx].code;
+  }
+
+  seterror(ctx, ERR_NOSUCHLINE);
+  return 0;
+}
+
+/*
+  check the arrays indexed by a loop variable on entry to the loop.
+  Params: pc - the OP_FOR instruction
+		  from - start value
+		  to - end value
+		  step - step
+  Returns: 1 if every value the variable takes is in range, else 0
+  Notes: the variable only keeps the proof until it is assigned,
+		 steps out of the loop, or another DIM is executed.
+*/
+static int checkrange(mb_context *ctx, const INSTR *pc, double from, double to, double step)
+{
+  DIMVAR *dv;
+  double lo;
+  double hi;
+  int i;
+
+  if(step > 0)
+  {
+	lo = from;
+	hi = to;
+  }
+  else if(step < 0)
+  {
+	lo = to;
+	hi = from;
+  }
+  else if(step == 0)
+	lo = hi = from;
+  else
+	return 0;
+
+  if(!(lo >= 1))
+	return 0;
+  for(i=pc->n;i!=-1;i=ctx->prog->checks[i].next)
+  {
+	dv = &ctx->dimvariables[ctx->prog->checks[i].id];
+	if(dv->ndims != 1 || !(hi < dv->dim[0] + 1.0))
+	  return 0;
+  }
+
+  return 1;
+}
+
+/*
+  Parse a line. High level compile function
+*/
+static void line(mb_context *ctx)
+{
+  match(ctx, VALUE);
+
+  switch(ctx->token)
   {
     case PRINT:
-	  doprint();
+	  doprint(ctx);
 	  break;
     case LET:
-	  dolet();
+	  dolet(ctx);
 	  break;
 	case DIM:
-	  dodim();
+	  dodim(ctx);
 	  break;
 	case IF:
-	  answer = doif();
+	  doif(ctx);
 	  break;
 	case GOTO:
-	  answer = dogoto();
+	  dogoto(ctx);
 	  break;
 	case INPUT:
-	  doinput();
+	  doinput(ctx);
 	  break;
 	case REM:
-	  dorem();
-	  return 0;
+	  dorem(ctx);
+	  return;
 	  break;
 	case FOR:
-	  answer = dofor();
+	  dofor(ctx);
 	  break;
 	case NEXT:
-	  answer = donext();
+	  donext(ctx);
 	  break;
 	default:
-	  seterror(ERR_SYNTAX);
+	  seterror(ctx, ERR_SYNTAX);
 	  break;
   }
 
-  if(token != EOS)
-	match(VALUE);
-
-  return answer;
+  if(ctx->token != EOS)
+	seterror(ctx, ERR_SYNTAX);
 }
 
 /*
   the PRINT statement
 */
-static void doprint(void)
+static void doprint(mb_context *ctx)
 {
-  char *str;
-  double x;
-
-  match(PRINT);
+  match(ctx, PRINT);
 
   while(1)
   {
-    if(isstring(token))
+	if(isstring(ctx->token))
 	{
-      str = stringexpr();
-	  if(str)
-	  {
-        fprintf(fpout, "%s", str);
-        free(str);
-	  }
+	  stringexpr(ctx);
+	  emit(ctx, OP_PRINTSTR, 0, 0);
 	}
 	else
 	{
-	  x = expr();
-	  fprintf(fpout, "%g", x);
+	  expr(ctx);
+	  emit(ctx, OP_PRINTNUM, 0, 0);
 	}
-	if(token == COMMA)
+	if(ctx->token == COMMA)
 	{
-	  fprintf(fpout, " ");
-	  match(COMMA);
+	  emit(ctx, OP_PRINTCHAR, ' ', 0);
+	  match(ctx, COMMA);
 	}
 	else
 	  break;
   }
-  fprintf(fpout, "\n");
+  emit(ctx, OP_PRINTCHAR, '\n', 0);
 }
 
 /*
   the LET statement
 */
-static void dolet(void)
+static void dolet(mb_context *ctx)
 {
   LVALUE lv;
-  char *temp;
+  int n;
 
-  match(LET);
-  lvalue(&lv);
-  match(EQUALS);
+  match(ctx, LET);
+  lvalue(ctx, &lv);
+  match(ctx, EQUALS);
+  if(lv.ndims == 0)
+	ctx->target = lv.id;
   switch(lv.type)
   {
     case FLTID:
-	  *lv.dval = expr();
+	  expr(ctx);
 	  break;
     case STRID:
-	  temp = *lv.sval;
-	  *lv.sval = stringexpr();
-	  if(temp)
-		free(temp);
+	  /* LET A$ = A$ + ... appends to A$ where it is */
+	  if(lv.ndims == 0 && ctx->token == STRID && ctx->curtok->id == lv.id
+		&& ctx->curtok[1].type == PLUS)
+	  {
+		match(ctx, STRID);
+		n = 0;
+		while(ctx->token == PLUS)
+		{
+		  match(ctx, PLUS);
+		  stringterm(ctx);
+		  n++;
+		}
+		emit(ctx, OP_APPENDSTR, lv.id, n);
+		ctx->target = -1;
+		return;
+	  }
+	  stringexpr(ctx);
 	  break;
   }
+  ctx->target = -1;
+  storelvalue(ctx, &lv);
 }
 
 /*
   the DIM statement
 */
-static void dodim(void)
+static void dodim(mb_context *ctx)
 {
-  int ndims = 0;
-  double dims[6];
-  char name[32];
-  int len;
-  DIMVAR *dimvar;
+  int ndims;
+  int id;
+  int type;
   int i;
-  int size = 1;
 
-  match(DIM);
+  match(ctx, DIM);
 
-  switch(token)
+  if(ctx->token != DIMFLTID && ctx->token != DIMSTRID)
   {
-    case DIMFLTID:
-	case DIMSTRID:
-      getid(string, name, &len);
-	  match(token);
-	  dims[ndims++] = expr();
-	  while(token == COMMA)
-	  {
-	    match(COMMA);
-	    dims[ndims++] = expr();
-		if(ndims > 5)
-		{
-		  seterror(ERR_TOOMANYDIMS);
-		  return;
-		}
-	  } 
-
-	  match(CPAREN);
-	  
-	  for(i=0;i<ndims;i++)
-	  {
-	    if(dims[i] < 0 || dims[i] != (int) dims[i])
-		{
-		  seterror(ERR_BADSUBSCRIPT);
-		  return;
-		}
-	  }
-	  switch(ndims)
-	  {
-	    case 1:
-		  dimvar = dimension(name, 1, (int) dims[0]);
-		  break;
-		case 2:
-		  dimvar = dimension(name, 2, (int) dims[0], (int) dims[1]);
-		  break;
-		case 3:
-		  dimvar = dimension(name, 3, (int) dims[0], (int) dims[1], (int) dims[2]);
-		  break;
-		case 4:
-		  dimvar = dimension(name, 4, (int) dims[0], (int) dims[1], (int) dims[2], (int) dims[3]);
-		  break;
-		case 5:
-		  dimvar = dimension(name, 5, (int) dims[0], (int) dims[1], (int) dims[2], (int) dims[3], (int) dims[4]);
-		  break;
-	  }
-	  break;
-	default:
-	    seterror(ERR_SYNTAX);
-	    return;
-  }
-  if(dimvar == 0)
-  {
-	/* out of memory */
-	seterror(ERR_OUTOFMEMORY);
+	seterror(ctx, ERR_SYNTAX);
 	return;
   }
+  type = ctx->token;
+  id = ctx->curtok->id;
+  match(ctx, ctx->token);
+  ndims = subscripts(ctx);
+  emit(ctx, OP_DIM, id, ndims);
 
-
-  if(token == EQUALS)
+  if(ctx->token == EQUALS)
   {
-    match(EQUALS);
+	match(ctx, EQUALS);
 
-	for(i=0;i<dimvar->ndims;i++)
-	  size *= dimvar->dim[i];
-
-	switch(dimvar->type)
+	i = 0;
+	while(1)
 	{
-      case FLTID:
-		i = 0;
-	    dimvar->dval[i++] = expr();
-		while(token == COMMA && i < size)
-		{
-		  match(COMMA);
-		  dimvar->dval[i++] = expr();
-		  if(errorflag)
-			break;
-		}
-		break;
-	  case STRID:
-		i = 0;
-		if(dimvar->str[i])
-		  free(dimvar->str[i]);
-		dimvar->str[i++] = stringexpr();
-
-		while(token == COMMA && i < size)
-		{
-		  match(COMMA);
-		  if(dimvar->str[i])
-		    free(dimvar->str[i]);
-		  dimvar->str[i++] = stringexpr();
-		  if(errorflag)
-			break;
-		}
+	  if(type == DIMFLTID)
+	  {
+		expr(ctx);
+		emit(ctx, OP_DIMINIT, id, i++);
+	  }
+	  else
+	  {
+		stringexpr(ctx);
+		emit(ctx, OP_DIMINITSTR, id, i++);
+	  }
+	  if(ctx->token != COMMA || ctx->errorflag)
 		break;
+	  match(ctx, COMMA);
 	}
-	
-	if(token == COMMA)
-	  seterror(ERR_TOOMANYINITS);
   }
 
 }
 
 /*
   the IF statement.
-  if jump taken, returns new line no, else returns 0
+  the target is compiled even if the jump is not taken
 */
-static int doif(void)
+static void doif(mb_context *ctx)
 {
-  int condition;
-  int jump;
-
-  match(IF);
-  condition = boolexpr();
-  match(THEN);
-  jump = (int) expr();
-  if(condition)
-	return jump;
-  else
-	return 0;
+  int start;
+
+  match(ctx, IF);
+  boolexpr(ctx);
+  match(ctx, THEN);
+  start = ctx->build->ncode;
+  expr(ctx);
+  if(!emitjump(ctx, start, OP_JUMPIF))
+	emit(ctx, OP_IF, 0, 0);
 }
 
 /*
   the GOTO satement
-  returns new line number
 */
-static int dogoto(void)
+static void dogoto(mb_context *ctx)
 {
-  match(GOTO);
-  return (int) expr();
+  int start;
+
+  match(ctx, GOTO);
+  start = ctx->build->ncode;
+  expr(ctx);
+  if(!emitjump(ctx, start, OP_JUMP))
+	emit(ctx, OP_GOTO, 0, 0);
 }
 
 /*
   The FOR statement.
-
-  Pushes the for stack.
-  Returns line to jump to, or -1 to end program
-
+  The counting variable must be a scalar.
 */
-static int dofor(void)
+static void dofor(mb_context *ctx)
 {
-  LVALUE lv;
-  char id[32];
-  char nextid[32];
-  int len;
-  double initval;
-  double toval;
-  double stepval;
-  const char *savestring;
-  int answer;
-
-  match(FOR);
-  getid(string, id, &len);
-
-  lvalue(&lv);
-  if(lv.type != FLTID)
-  {
-    seterror(ERR_BADTYPE);
-	return -1;
-  }
-  match(EQUALS);
-  initval = expr();
-  match(TO);
-  toval = expr();
-  if(token == STEP)
-  {
-    match(STEP);
-	stepval = expr();
-  }
-  else
-    stepval = 1.0;
+  int id;
 
-  *lv.dval = initval;
-
-  if(nfors > 31)
+  match(ctx, FOR);
+  if(ctx->token != FLTID)
   {
-	seterror(ERR_TOOMANYFORS);
-	return -1;
+	seterror(ctx, ctx->token == STRID ? ERR_BADTYPE : ERR_SYNTAX);
+	return;
   }
-
-  if(stepval < 0 && initval < toval || stepval > 0 && initval > toval)
+  id = ctx->curtok->id;
+  match(ctx, FLTID);
+  match(ctx, EQUALS);
+  ctx->target = id;
+  expr(ctx);
+  match(ctx, TO);
+  expr(ctx);
+  if(ctx->token == STEP)
   {
-	savestring = string;
-    while(string = strchr(string, '\n'))
-	{
-      errorflag = 0;
-	  token = gettoken(string);
-	  match(VALUE);
-	  if(token == NEXT)
-	  {
-	    match(NEXT);
-		if(token == FLTID || token == DIMFLTID)
-		{
-          getid(string, nextid, &len);
-		  if(!strcmp(id, nextid))
-		  {
-			answer = getnextline(string);
-			string = savestring;
-			token = gettoken(string);
-			return answer ? answer : -1;
-		  }
-		}
-	  }
-	}
-
-	seterror(ERR_NONEXT);
-	return -1;
+	match(ctx, STEP);
+	expr(ctx);
   }
   else
-  {
-	strcpy(forstack[nfors].id, id);
-	forstack[nfors].nextline = getnextline(string);
-	forstack[nfors].step = stepval;
-	forstack[nfors].toval = toval;
-	nfors++;
-    return 0;
-  }
+	emitvalue(ctx, 1.0);
+  ctx->target = -1;
 
+  if(emit(ctx, OP_FOR, id, -1) && ctx->nforcode < 32)
+	ctx->forcode[ctx->nforcode++] = ctx->build->ncode - 1;
 }
 
 /*
   the NEXT statement
-  updates the counting index, and returns line to jump to
 */
-static int donext(void)
+static void donext(mb_context *ctx)
 {
-  char id[32];
-  int len;
-  LVALUE lv;
+  int id;
+  int i;
 
-  match(NEXT);
+  match(ctx, NEXT);
 
-  if(nfors)
+  if(ctx->token != FLTID)
   {
-    getid(string, id, &len);
-    lvalue(&lv);
-    *lv.dval += forstack[nfors-1].step;
-	if( (forstack[nfors-1].step < 0 && *lv.dval < forstack[nfors-1].toval) ||
-		(forstack[nfors-1].step > 0 && *lv.dval > forstack[nfors-1].toval) )
-	{
-	  nfors--;
-	  return 0;
-	}
-	else
+	seterror(ctx, ctx->token == STRID ? ERR_BADTYPE : ERR_SYNTAX);
+	return;
+  }
+  id = ctx->curtok->id;
+  match(ctx, FLTID);
+  emit(ctx, OP_NEXT, id, 0);
+
+  for(i=ctx->nforcode-1;i>=0;i--)
+	if(ctx->build->code[ctx->forcode[i]].arg == id)
 	{
-      return forstack[nfors-1].nextline;
+	  ctx->nforcode = i;
+	  break;
 	}
-  }
-  else
-  {
-    seterror(ERR_NOFOR);
-	return -1;
-  }
 }
 
 
 /*
   the INPUT statement
 */
-static void doinput(void)
+static void doinput(mb_context *ctx)
 {
   LVALUE lv;
-  char buff[1024];
-  char *end;
-
-  match(INPUT);
-  lvalue(&lv);
 
-  switch(lv.type)
-  {
-  case FLTID:
-	while(fscanf(fpin, "%lf", lv.dval) != 1)
-	{
-	  fgetc(fpin);
-	  if(feof(fpin))
-	  {
-	    seterror(ERR_EOF);
-	    return;
-	  }
-	}
-	break;
-  case STRID:
-	if(*lv.sval)
-	{
-	  free(*lv.sval);
-	  *lv.sval = 0;
-	}
-	fgets(buff, sizeof(buff), fpin);
-	end = strchr(buff, '\n');
-	if(!end)
-	{
-	  errorflag = 1;
-	  return;
-	}
-	*end = 0;
-	*lv.sval = mystrdup(buff);
-	if(!*lv.sval)
-	{
-      seterror(ERR_OUTOFMEMORY);
-	  return;
-	}
+  match(ctx, INPUT);
+  lvalue(ctx, &lv);
+
+  switch(lv.type)
+  {
+  case FLTID:
+	emit(ctx, OP_INPUTNUM, 0, 0);
+	break;
+  case STRID:
+	emit(ctx, OP_INPUTSTR, 0, 0);
 	break;
   default:
 	  return;
   }
+  storelvalue(ctx, &lv);
 }
 
 /*
@@ -943,141 +2764,149 @@ static void doinput(void)
   Note is unique as the rest of the line is not parsed
 
 */
-static void dorem(void)
+static void dorem(mb_context *ctx)
 {
-  match(REM);
+  match(ctx, REM);
   return;
 }
 
 /*
-  Get an lvalue from the environment
+  Compile an lvalue.
   Params: lv - structure to fill.
-  Notes: missing variables (but not out of range subscripts)
-         are added to the variable list.
+  Notes: array subscripts are compiled here, the
+		 store by storelvalue() once the value is on the stack.
+		 A scalar is created before its value is evaluated,
+		 so may be read in the expression.
 */
-static void lvalue(LVALUE *lv)
+static void lvalue(mb_context *ctx, LVALUE *lv)
 {
-  char name[32];
-  int len;
-  VARIABLE *var;
-  DIMVAR *dimvar;
-  int index[5];
-  void *valptr = 0;
-  int type;
-  
+  int start;
+
   lv->type = ERROR;
-  lv->dval = 0;
-  lv->sval = 0;
-  lv->ival = 0;
+  lv->id = -1;
+  lv->ndims = 0;
+  lv->forpc = -1;
 
-  switch(token)
+  switch(ctx->token)
   {
     case FLTID:
-	  getid(string, name, &len);
-	  match(FLTID);
-	  var = findvariable(name);
-	  if(!var)
-		var = addfloat(name);
-	  if(!var)
-	  {
-	    seterror(ERR_OUTOFMEMORY);
-		return;
-	  }
-	  lv->type = FLTID;
-	  lv->dval = &var->dval;
-	  lv->sval = 0;
-	  break;
-    case STRID:
-	  getid(string, name, &len);
-	  match(STRID);
-	  var = findvariable(name);
-	  if(!var)
-		var = addstring(name);
-	  if(!var)
-	  {
-	    seterror(ERR_OUTOFMEMORY);
-		return;
-	  }
-	  lv->type = STRID;
-	  lv->sval = &var->sval;
-	  lv->dval = 0;
+	case STRID:
+	  lv->type = ctx->token;
+	  lv->id = ctx->curtok->id;
+	  match(ctx, ctx->token);
 	  break;
 	case DIMFLTID:
 	case DIMSTRID:
-		type = (token == DIMFLTID) ? FLTID : STRID;
-	  getid(string, name, &len);
-	  match(token);
-	  dimvar = finddimvar(name);
-	  if(dimvar)
-	  {
-	    switch(dimvar->ndims)
-		{
-		  case 1:
-			index[0] = (int) expr();
-			if(errorflag == 0)
-              valptr = getdimvar(dimvar, index[0]);
-			break;
-		  case 2:
-			index[0] = (int) expr();
-			match(COMMA);
-			index[1] = (int) expr();
-			if(errorflag == 0)
-			  valptr = getdimvar(dimvar, index[0], index[1]);
-			break;
-		  case 3:
-			index[0] = (int) expr();
-			match(COMMA);
-			index[1] = (int) expr();
-			match(COMMA);
-            index[2] = (int) expr();
-			if(errorflag == 0)
-			  valptr = getdimvar(dimvar, index[0], index[1], index[2]);
-			break;
-		  case 4:
-			index[0] = (int) expr();
-			match(COMMA);
-			index[1] = (int) expr();
-			match(COMMA);
-            index[2] = (int) expr();
-			match(COMMA);
-			index[3] = (int) expr();
-			if(errorflag == 0)
-			  valptr = getdimvar(dimvar, index[0], index[1], index[2], index[3]);
-			break;
-		  case 5:
-			index[0] = (int) expr();
-			match(COMMA);
-			index[1] = (int) expr();
-			match(COMMA);
-            index[2] = (int) expr();
-			match(COMMA);
-			index[3] = (int) expr();
-			match(COMMA);
-			index[4] = (int) expr();
-			if(errorflag == 0)
-			  valptr = getdimvar(dimvar, index[0], index[1], index[2], index[3]);
-			break;
-		}
-		match(CPAREN);
-	  }
+	  lv->type = (ctx->token == DIMFLTID) ? FLTID : STRID;
+	  lv->id = ctx->curtok->id;
+	  match(ctx, ctx->token);
+	  start = ctx->build->ncode;
+	  lv->ndims = subscripts(ctx);
+	  if(lv->type == FLTID)
+		lv->forpc = hoistcheck(ctx, lv->id, start, lv->ndims);
+	  break;
+	default:
+	  seterror(ctx, ERR_SYNTAX);
+  }
+}
+
+/*
+  store the value on top of the stack into an lvalue
+  Params: lv - the lvalue from lvalue()
+*/
+static void storelvalue(mb_context *ctx, const LVALUE *lv)
+{
+  switch(lv->type)
+  {
+	case FLTID:
+	  if(lv->forpc != -1)
+		emit(ctx, OP_STOREDIMV, lv->id, lv->forpc);
 	  else
+		emit(ctx, lv->ndims ? OP_STOREDIM : OP_STOREVAR, lv->id, lv->ndims);
+	  break;
+	case STRID:
+	  emit(ctx, lv->ndims ? OP_STOREDIMSTR : OP_STORESTR, lv->id, lv->ndims);
+	  break;
+  }
+}
+
+/*
+  compile the subscripts of an array, and the closing parenthesis
+  Returns: the number of subscripts
+*/
+static int subscripts(mb_context *ctx)
+{
+  int n = 1;
+
+  expr(ctx);
+  while(ctx->token == COMMA)
+  {
+	match(ctx, COMMA);
+	expr(ctx);
+	n++;
+  }
+  match(ctx, CPAREN);
+
+  if(n > 5)
+	seterror(ctx, ERR_TOOMANYDIMS);
+
+  return n;
+}
+
+/*
+  hoist the bounds check of an array indexed by a loop variable.
+  Params: id - the array
+		  start - first instruction of the subscripts
+		  nsubs - number of subscripts
+  Returns: the enclosing OP_FOR, or -1 if the access must be checked.
+  Notes: on success the load of the subscript is removed, and the
+		 array is added to the arrays the FOR checks on entry.
+*/
+static int hoistcheck(mb_context *ctx, int id, int start, int nsubs)
+{
+  mb_program *prog = ctx->build;
+  RANGECHECK *temp;
+  int forpc = -1;
+  int i;
+
+  if(ctx->errorflag || nsubs != 1 || prog->ncode != start + 1)
+	return -1;
+  if(prog->code[start].op != OP_LOADVAR || prog->code[start].n)
+	return -1;
+  for(i=ctx->nforcode-1;i>=0;i--)
+	if(prog->code[ctx->forcode[i]].arg == prog->code[start].arg)
+	{
+	  forpc = ctx->forcode[i];
+	  break;
+	}
+  if(forpc == -1)
+	return -1;
+
+  for(i=prog->code[forpc].n;i!=-1;i=prog->checks[i].next)
+	if(prog->checks[i].id == id)
+	  break;
+  if(i == -1)
+  {
+	if(prog->nchecks == prog->maxchecks)
+	{
+	  temp = realloc(prog->checks, (prog->maxchecks + 16) * 2 * sizeof(RANGECHECK));
+	  if(!temp)
 	  {
-	    seterror(ERR_NOSUCHVARIABLE);
-        return;
-      }
-	  if(valptr)
-	  {
-		lv->type = type;
-	    if(type == FLTID)
-	      lv->dval = valptr;
-	    else if(type == STRID)
-	      lv->sval = valptr;
-		else
-		  assert(0);
+		seterror(ctx, ERR_OUTOFMEMORY);
+		return -1;
 	  }
-	default:
-	  seterror(ERR_SYNTAX);
+	  prog->checks = temp;
+	  prog->maxchecks = (prog->maxchecks + 16) * 2;
+	}
+	prog->checks[prog->nchecks].id = id;
+	prog->checks[prog->nchecks].next = prog->code[forpc].n;
+	prog->code[forpc].n = prog->nchecks++;
   }
+
+  prog->ncode = start;
+  ctx->ddepth--;
+
+  return forpc;
 }
 
 /*
@@ -1085,28 +2914,22 @@ static void lvalue(LVALUE *lv)
   consists of expressions or strings and relational operators,
   and parentheses
 */
-static int boolexpr(void)
+static void boolexpr(mb_context *ctx)
 {
-  int left;
-  int right;
-  
-  left = boolfactor();
+  boolfactor(ctx);
 
-  while(1)
+  switch(ctx->token)
   {
-    switch(token)
-	{
-	  case AND:
-        match(AND);
-		right = boolexpr();
-		return (left && right) ? 1 : 0;
-	  case OR:
-	    match(OR);
-		right = boolexpr();
-		return (left || right) ? 1 : 0;
-	  default:
-		return left;
-	}
+	case AND:
+	  match(ctx, AND);
+	  boolexpr(ctx);
+	  emit(ctx, OP_AND, 0, 0);
+	  break;
+	case OR:
+	  match(ctx, OR);
+	  boolexpr(ctx);
+	  emit(ctx, OP_OR, 0, 0);
+	  break;
   }
 }
 
@@ -1114,135 +2937,69 @@ static int boolexpr(void)
   boolean factor, consists of expression relop expression
     or string relop string, or ( boolexpr() )
 */
-static int boolfactor(void)
+static void boolfactor(mb_context *ctx)
 {
-  int answer;
-  double left;
-  double right;
   int op;
-  char *strleft;
-  char *strright;
-  int cmp;
 
-  switch(token)
+  switch(ctx->token)
   {
     case OPAREN:
-	  match(OPAREN);
-	  answer = boolexpr();
-	  match(CPAREN);
+	  match(ctx, OPAREN);
+	  boolexpr(ctx);
+	  match(ctx, CPAREN);
 	  break;
 	default:
-	  if(isstring(token))
+	  if(isstring(ctx->token))
 	  {
-	    strleft = stringexpr();
-		op = relop();
-		strright = stringexpr();
-		if(!strleft || !strright)
-		{
-		  if(strleft)
-		    free(strleft);
-		  if(strright)
-		    free(strright);
-		  return 0;
-		}
-		cmp = strcmp(strleft, strright);
-		switch(op)
-		{
-		  case ROP_EQ:
-			  answer = cmp == 0 ? 1 : 0;
-			  break;
-		  case ROP_NEQ:
-			  answer = cmp == 0 ? 0 : 1;
-			  break;
-		  case ROP_LT:
-			  answer = cmp < 0 ? 1 : 0;
-			  break;
-		  case ROP_LTE:
-			  answer = cmp <= 0 ? 1 : 0;
-			  break;
-		  case ROP_GT:
-			  answer = cmp > 0 ? 1 : 0;
-			  break;
-		  case ROP_GTE:
-			  answer = cmp >= 0 ? 1 : 0;
-			  break;
-		  default:
-			answer = 0;
-		}
-		free(strleft);
-		free(strright);
+		stringexpr(ctx);
+		op = relop(ctx);
+		stringexpr(ctx);
+		emit(ctx, OP_SCMP, op, 0);
 	  }
 	  else
 	  {
-	    left = expr();
-		op = relop();
-		right = expr();
-		switch(op)
-		{
-		  case ROP_EQ:
-			  answer = (left == right) ? 1 : 0;
-			  break;
-		  case ROP_NEQ:
-			  answer = (left != right) ? 1 : 0;
-			  break;
-		  case ROP_LT:
-			  answer = (left < right) ? 1 : 0;
-			  break;
-		  case ROP_LTE:
-			  answer = (left <= right) ? 1 : 0;
-			  break;
-		  case ROP_GT:
-			  answer = (left > right) ? 1 : 0;
-			  break;
-		  case ROP_GTE:
-			  answer = (left >= right) ? 1 : 0;
-			  break;
-		  default:
-			 errorflag = 1;
-			 return 0;
-
-		}
+		expr(ctx);
+		op = relop(ctx);
+		expr(ctx);
+		emit(ctx, OP_CMP, op, 0);
 	  }
-	  
   }
-
-  return answer;
 }
 
 /*
   get a relational operator
   returns operator parsed or ERROR
 */
-static int relop(void)
+static int relop(mb_context *ctx)
 {
-  switch(token)
+  switch(ctx->token)
   {
     case EQUALS:
-	  match(EQUALS);
+	  match(ctx, EQUALS);
 	  return ROP_EQ;
     case GREATER:
-	  match(GREATER);
-	  switch(token)
+	  match(ctx, GREATER);
+	  switch(ctx->token)
 	  {
 	    case EQUALS:
-		  match(EQUALS);
+		  match(ctx, EQUALS);
 		  return ROP_GTE;
 	    case LESS:
-		  match(LESS);
+		  match(ctx, LESS);
           return ROP_NEQ;
 	    default:
 		  return ROP_GT;
 	  }
 	case LESS:
-      match(LESS);
-	  if(token == EQUALS)
+	  match(ctx, LESS);
+	  if(ctx->token == EQUALS)
 	  {
-	    match(EQUALS);
+		match(ctx, EQUALS);
 		return ROP_LTE;
 	  }
 	  return ROP_LT;
 	default:
-	  seterror(ERR_SYNTAX);
+	  seterror(ctx, ERR_SYNTAX);
 	  return ERROR;
   }
 }
@@ -1250,29 +3007,30 @@ static int relop(void)
 /*
   parses an expression
 */
-static double expr(void)
+static void expr(mb_context *ctx)
 {
-  double left;
-  double right;
+  int left = ctx->build->ncode;
+  int right;
 
-  left = term();
+  term(ctx);
 
   while(1)
   {
-    switch(token)
+	right = ctx->build->ncode;
+	switch(ctx->token)
 	{
 	case PLUS:
-	  match(PLUS);
-	  right = term();
-	  left += right;
+	  match(ctx, PLUS);
+	  term(ctx);
+	  emitbinary(ctx, OP_ADD, left, right);
 	  break;
 	case MINUS:
-	  match(MINUS);
-      right = term();
-	  left -= right;
+	  match(ctx, MINUS);
+	  term(ctx);
+	  emitbinary(ctx, OP_SUB, left, right);
 	  break;
 	default:
-	  return left;
+	  return;
 	}
   }
 }
@@ -1280,37 +3038,35 @@ static double expr(void)
 /*
   parses a term 
 */
-static double term(void)
+static void term(mb_context *ctx)
 {
-  double left;
-  double right;
+  int left = ctx->build->ncode;
+  int right;
 
-  left = factor();
+  factor(ctx);
   
   while(1)
   {
-    switch(token)
+	right = ctx->build->ncode;
+	switch(ctx->token)
 	{
 	case MULT:
-	  match(MULT);
-	  right = factor();
-	  left *= right;
+	  match(ctx, MULT);
+	  factor(ctx);
+	  emitbinary(ctx, OP_MUL, left, right);
 	  break;
 	case DIV:
-	  match(DIV);
-	  right = factor();
-	  if(right != 0.0)
-	    left /= right;
-	  else
-		seterror(ERR_DIVIDEBYZERO);
+	  match(ctx, DIV);
+	  factor(ctx);
+	  emitbinary(ctx, OP_DIV, left, right);
 	  break;
 	case MOD:
-	  match(MOD);
-	  right = factor();
-	  left = fmod(left, right);
+	  match(ctx, MOD);
+	  factor(ctx);
+	  emitbinary(ctx, OP_MOD, left, right);
 	  break;
 	default:
-	  return left;
+	  return;
 	}
   }
 
@@ -1319,381 +3075,648 @@ static double term(void)
 /*
   parses a factor
 */
-static double factor(void)
+static void factor(mb_context *ctx)
 {
-  double answer = 0;
-  char *str;
-  int len;
+  int first = ctx->build->ncode;
+  int id;
+  int n;
+  int start;
+  int forpc;
 
-  switch(token)
+  switch(ctx->token)
   {
     case OPAREN:
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
+	  match(ctx, OPAREN);
+	  expr(ctx);
+	  match(ctx, CPAREN);
 	  break;
 	case VALUE:
-	  answer = getvalue(string, &len);
-	  match(VALUE);
+	  emitvalue(ctx, ctx->curtok->value);
+	  match(ctx, VALUE);
 	  break;
 	case MINUS:
-	  match(MINUS);
-	  answer = -factor();
+	  match(ctx, MINUS);
+	  factor(ctx);
+	  emitunary(ctx, OP_NEG, first);
 	  break;
 	case FLTID:
-	  answer = variable();
+	  emit(ctx, OP_LOADVAR, ctx->curtok->id, ctx->curtok->id == ctx->target);
+	  match(ctx, FLTID);
 	  break;
 	case DIMFLTID:
-	  answer = dimvariable();
+	  id = ctx->curtok->id;
+	  match(ctx, DIMFLTID);
+	  start = ctx->build->ncode;
+	  n = subscripts(ctx);
+	  forpc = hoistcheck(ctx, id, start, n);
+	  if(forpc != -1)
+		emit(ctx, OP_LOADDIMV, id, forpc);
+	  else
+		emit(ctx, OP_LOADDIM, id, n);
+	  break;
+	case E:
+	  emitvalue(ctx, exp(1.0));
+	  match(ctx, E);
+	  break;
+	case PI:
+	  emitvalue(ctx, acos(0.0) * 2.0);
+	  match(ctx, PI);
+	  break;
+	case SIN:
+	  builtin(ctx, SIN, OP_SIN, FLTID);
+	  break;
+	case COS:
+	  builtin(ctx, COS, OP_COS, FLTID);
+	  break;
+	case TAN:
+	  builtin(ctx, TAN, OP_TAN, FLTID);
+	  break;
+	case LN:
+	  builtin(ctx, LN, OP_LN, FLTID);
+	  break;
+	case POW:
+	  match(ctx, POW);
+	  match(ctx, OPAREN);
+	  expr(ctx);
+	  match(ctx, COMMA);
+	  start = ctx->build->ncode;
+	  expr(ctx);
+	  match(ctx, CPAREN);
+	  emitbinary(ctx, OP_POW, first, start);
+	  break;
+	case SQRT:
+	  builtin(ctx, SQRT, OP_SQRT, FLTID);
+	  break;
+	case ABS:
+	  builtin(ctx, ABS, OP_ABS, FLTID);
+	  break;
+    case LEN:
+	  builtin(ctx, LEN, OP_LEN, STRID);
+	  break;
+    case ASCII:
+	  builtin(ctx, ASCII, OP_ASCII, STRID);
+	  break;
+    case ASIN:
+	  builtin(ctx, ASIN, OP_ASIN, FLTID);
+	  break;
+    case ACOS:
+	  builtin(ctx, ACOS, OP_ACOS, FLTID);
+	  break;
+    case ATAN:
+	  builtin(ctx, ATAN, OP_ATAN, FLTID);
+	  break;
+    case INT:
+	  builtin(ctx, INT, OP_INT, FLTID);
+	  break;
+    case RND:
+	  builtin(ctx, RND, OP_RND, FLTID);
+	  break;
+    case VAL:
+	  builtin(ctx, VAL, OP_VAL, STRID);
+	  break;
+	default:
+	  if(isstring(ctx->token))
+		seterror(ctx, ERR_TYPEMISMATCH);
+	  else
+		seterror(ctx, ERR_SYNTAX);
+	  break;
+  }
+
+  while(ctx->token == SHRIEK)
+  {
+	match(ctx, SHRIEK);
+	emitunary(ctx, OP_FACT, first);
+  }
+}
+
+/*
+  compile a call to a function of one argument.
+  Params: tok - the function's token
+		  op - opcode to emit
+		  argtype - FLTID or STRID, type of the argument
+*/
+static void builtin(mb_context *ctx, int tok, int op, int argtype)
+{
+  int start = ctx->build->ncode;
+
+  match(ctx, tok);
+  match(ctx, OPAREN);
+  if(argtype == STRID)
+	stringexpr(ctx);
+  else
+	expr(ctx);
+  match(ctx, CPAREN);
+  if(argtype == STRID)
+	emit(ctx, op, 0, 0);
+  else
+	emitunary(ctx, op, start);
+}
+
+/*
+  high level string parsing function.
+  Notes: leaves one string on the string stack. A chain of + is
+		 joined by one instruction, so each piece is copied once.
+*/
+static void stringexpr(mb_context *ctx)
+{
+  int n = 1;
+
+  stringterm(ctx);
+  while(ctx->token == PLUS)
+  {
+	match(ctx, PLUS);
+	stringterm(ctx);
+	n++;
+  }
+  if(n > 1)
+	emit(ctx, OP_CONCAT, 0, n);
+}
+
+/*
+  parse one string, a piece of a chain of concatenations.
+  Notes: pushes the string on the string stack.
+*/
+static void stringterm(mb_context *ctx)
+{
+  int id;
+  int n;
+  int len;
+
+  switch(ctx->token)
+  {
+	case DIMSTRID:
+	  id = ctx->curtok->id;
+	  match(ctx, DIMSTRID);
+	  n = subscripts(ctx);
+	  emit(ctx, OP_LOADDIMSTR, id, n);
+	  break;
+	case STRID:
+	  emit(ctx, OP_LOADSTR, ctx->curtok->id, ctx->curtok->id == ctx->target);
+	  match(ctx, STRID);
+	  break;
+	case QUOTE:
+	  id = ctx->curtok - ctx->build->tokens;
+	  n = 0;
+	  while(ctx->token == QUOTE)
+	  {
+		match(ctx, QUOTE);
+		n++;
+	  }
+	  id = internliteral(ctx, id, n, &len);
+	  if(id != -1)
+		emit(ctx, OP_PUSHLIT, id, len);
+	  break;
+	case CHRSTRING:
+	  builtin(ctx, CHRSTRING, OP_CHR, FLTID);
+	  break;
+	case STRSTRING:
+	  builtin(ctx, STRSTRING, OP_STR, FLTID);
+	  break;
+	case LEFTSTRING:
+	  match(ctx, LEFTSTRING);
+	  match(ctx, OPAREN);
+	  stringexpr(ctx);
+	  match(ctx, COMMA);
+	  expr(ctx);
+	  match(ctx, CPAREN);
+	  emit(ctx, OP_LEFT, 0, 0);
+	  break;
+	case RIGHTSTRING:
+	  match(ctx, RIGHTSTRING);
+	  match(ctx, OPAREN);
+	  stringexpr(ctx);
+	  match(ctx, COMMA);
+	  expr(ctx);
+	  match(ctx, CPAREN);
+	  emit(ctx, OP_RIGHT, 0, 0);
+	  break;
+	case MIDSTRING:
+	  match(ctx, MIDSTRING);
+	  match(ctx, OPAREN);
+	  stringexpr(ctx);
+	  match(ctx, COMMA);
+	  expr(ctx);
+	  match(ctx, COMMA);
+	  expr(ctx);
+	  match(ctx, CPAREN);
+	  emit(ctx, OP_MID, 0, 0);
+	  break;
+	case STRINGSTRING:
+	  match(ctx, STRINGSTRING);
+	  match(ctx, OPAREN);
+	  expr(ctx);
+	  match(ctx, COMMA);
+	  stringexpr(ctx);
+	  match(ctx, CPAREN);
+	  emit(ctx, OP_STRING, 0, 0);
+	  break;
+	default:
+	  if(!isstring(ctx->token))
+		seterror(ctx, ERR_TYPEMISMATCH);
+	  else
+		seterror(ctx, ERR_SYNTAX);
+	  return;
+  }
+}
+
+/*
+  add an instruction to the code.
+  Params: op - the opcode
+		  arg - identifier handle, operator or error code
+		  n - number of subscripts
+  Returns: the new instruction, 0 on out of memory
+  Notes: tracks the depth of the stacks.
+*/
+static INSTR *emit(mb_context *ctx, int op, int arg, int n)
+{
+  mb_program *prog = ctx->build;
+  INSTR *temp;
+
+  if(prog->ncode == prog->maxcode)
+  {
+	temp = realloc(prog->code, (prog->maxcode + 64) * 2 * sizeof(INSTR));
+	if(!temp)
+	{
+	  seterror(ctx, ERR_OUTOFMEMORY);
+	  return 0;
+	}
+	prog->code = temp;
+	prog->maxcode = (prog->maxcode + 64) * 2;
+  }
+  prog->code[prog->ncode].op = op;
+  prog->code[prog->ncode].arg = arg;
+  prog->code[prog->ncode].n = n;
+  prog->code[prog->ncode].link = 0;
+  prog->code[prog->ncode].val = 0.0;
+
+  ctx->ddepth -= opinfo[op].dpop + (opinfo[op].popn ? n : 0);
+  ctx->ddepth += opinfo[op].dpush;
+  ctx->sdepth -= opinfo[op].spop + (opinfo[op].spopn ? n : 0);
+  ctx->sdepth += opinfo[op].spush;
+  if(ctx->ddepth > prog->maxddepth)
+	prog->maxddepth = ctx->ddepth;
+  if(ctx->sdepth > prog->maxsdepth)
+	prog->maxsdepth = ctx->sdepth;
+
+  return &prog->code[prog->ncode++];
+}
+
+/*
+  add an instruction to push a constant.
+  Params: x - the constant
+*/
+static void emitvalue(mb_context *ctx, double x)
+{
+  INSTR *ins;
+
+  ins = emit(ctx, OP_PUSHNUM, 0, 0);
+  if(ins)
+	ins->val = x;
+}
+
+/*
+  replace a constant jump target by a direct jump.
+  Params: start - first instruction of the target expression
+		  op - OP_JUMP or OP_JUMPIF
+  Returns: 1 if the direct jump was emitted, 0 if the target is computed.
+  Notes: the line number is held in val until resolvejumps()
+		 converts it to an instruction index. A target folded from
+		 an expression stays computed, so it is only looked up if
+		 the jump is taken.
+*/
+static int emitjump(mb_context *ctx, int start, int op)
+{
+  mb_program *prog = ctx->build;
+  INSTR *ins;
+  double x;
+
+  if(ctx->errorflag || prog->ncode != start + 1 || prog->code[start].op != OP_PUSHNUM)
+	return 0;
+  if(prog->code[start].n)
+	return 0;
+
+  x = prog->code[start].val;
+  prog->ncode = start;
+  ctx->ddepth--;
+  ins = emit(ctx, op, 0, 0);
+  if(ins)
+	ins->val = x;
+
+  return 1;
+}
+
+/*
+  add an instruction taking one number, folding a constant argument.
+  Params: op - the opcode
+		  start - first instruction of the argument
+*/
+static void emitunary(mb_context *ctx, int op, int start)
+{
+  mb_program *prog = ctx->build;
+  INSTR *ins;
+  double x;
+
+  if(!ctx->errorflag && prog->ncode == start + 1 && prog->code[start].op == OP_PUSHNUM)
+  {
+	x = prog->code[start].val;
+	if(foldconstant(op, &x, 0.0))
+	{
+	  prog->ncode = start;
+	  ctx->ddepth--;
+	  ins = emit(ctx, OP_PUSHNUM, 0, 1);
+	  if(ins)
+		ins->val = x;
+	  return;
+	}
+  }
+  emit(ctx, op, 0, 0);
+}
+
+/*
+  add an instruction taking two numbers, folding constant arguments.
+  Params: op - the opcode
+		  left - first instruction of the left operand
+		  right - first instruction of the right operand
+  Notes: x*1, 1*x, x/1 and x-0 are reduced to x. x+0 is left, as
+		 it turns -0 into 0.
+*/
+static void emitbinary(mb_context *ctx, int op, int left, int right)
+{
+  mb_program *prog = ctx->build;
+  INSTR *ins;
+  int lconst;
+  int rconst;
+  double x;
+  double y;
+
+  if(ctx->errorflag)
+  {
+	emit(ctx, op, 0, 0);
+	return;
+  }
+  lconst = right == left + 1 && prog->code[left].op == OP_PUSHNUM;
+  rconst = prog->ncode == right + 1 && prog->code[right].op == OP_PUSHNUM;
+  x = lconst ? prog->code[left].val : 0.0;
+  y = rconst ? prog->code[right].val : 0.0;
+
+  if(lconst && rconst && foldconstant(op, &x, y))
+  {
+	prog->ncode = left;
+	ctx->ddepth -= 2;
+	ins = emit(ctx, OP_PUSHNUM, 0, 1);
+	if(ins)
+	  ins->val = x;
+  }
+  else if(rconst && y == 1.0 && (op == OP_MUL || op == OP_DIV))
+  {
+	prog->ncode = right;
+	ctx->ddepth--;
+  }
+  else if(rconst && y == 0.0 && 1.0 / y > 0.0 && op == OP_SUB)
+  {
+	prog->ncode = right;
+	ctx->ddepth--;
+  }
+  else if(lconst && x == 1.0 && op == OP_MUL)
+  {
+	memmove(prog->code + left, prog->code + right, (prog->ncode - right) * sizeof(INSTR));
+	prog->ncode--;
+	ctx->ddepth--;
+  }
+  else
+	emit(ctx, op, 0, 0);
+}
+
+/*
+  work out an operation on constants.
+  Params: op - the opcode
+		  x - the (first) argument, set to the result
+		  y - the second argument
+  Returns: 1 if folded, 0 if it must be left to run time
+  Notes: an operation which is an error is left, so it is reported
+		 if the line is executed. RND has state, so is never folded.
+		 factorial() takes time in proportion to its argument, so
+		 is only folded up to 170, the largest with a finite result.
+*/
+static int foldconstant(int op, double *x, double y)
+{
+  switch(op)
+  {
+	case OP_ADD:
+	  *x += y;
 	  break;
-	case E:
-	  answer = exp(1.0);
-	  match(E);
+	case OP_SUB:
+	  *x -= y;
 	  break;
-	case PI:
-	  answer = acos(0.0) * 2.0;
-	  match(PI);
+	case OP_MUL:
+	  *x *= y;
 	  break;
-	case SIN:
-	  match(SIN);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = sin(answer);
+	case OP_DIV:
+	  if(y == 0.0)
+		return 0;
+	  *x /= y;
 	  break;
-	case COS:
-	  match(COS);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = cos(answer);
+	case OP_MOD:
+	  *x = fmod(*x, y);
 	  break;
-	case TAN:
-	  match(TAN);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = tan(answer);
+	case OP_POW:
+	  *x = pow(*x, y);
 	  break;
-	case LN:
-	  match(LN);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  if(answer > 0)
-	    answer = log(answer);
-	  else
-		seterror(ERR_NEGLOG);
+	case OP_NEG:
+	  *x = -*x;
 	  break;
-	case POW:
-      match(POW);
-	  match(OPAREN);
-	  answer = expr();
-	  match(COMMA);
-      answer = pow(answer, expr());
-	  match(CPAREN);
+	case OP_FACT:
+	  if(!(*x >= 0.0 && *x <= 170.0 && *x == floor(*x)))
+		return 0;
+	  *x = factorial(*x);
 	  break;
-	case SQRT:
-	  match(SQRT);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  if(answer >= 0.0)
-		answer = sqrt(answer);
-	  else
-		seterror(ERR_NEGSQRT);
+	case OP_SIN:
+	  *x = sin(*x);
 	  break;
-	case ABS:
-	  match(ABS);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = fabs(answer);
+	case OP_COS:
+	  *x = cos(*x);
 	  break;
-    case LEN:
-	  match(LEN);
-	  match(OPAREN);
-	  str = stringexpr();
-	  match(CPAREN);
-	  if(str)
-	  {
-	    answer = strlen(str);
-	    free(str);
-	  }
-	  else
-		answer = 0;
+	case OP_TAN:
+	  *x = tan(*x);
 	  break;
-    case ASCII:
-	  match(ASCII);
-	  match(OPAREN);
-	  str = stringexpr();
-	  match(CPAREN);
-	  if(str)
-	  {
-		answer = *str;
-	    free(str);
-	  }
-	  else
-		answer = 0;
+	case OP_LN:
+	  if(*x <= 0)
+		return 0;
+	  *x = log(*x);
 	  break;
-    case ASIN:
-	  match(ASIN);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = asin(answer);
+	case OP_SQRT:
+	  if(*x < 0.0)
+		return 0;
+	  *x = sqrt(*x);
 	  break;
-    case ACOS:
-	  match(ACOS);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = acos(answer);
+	case OP_ABS:
+	  *x = fabs(*x);
 	  break;
-    case ATAN:
-	  match(ATAN);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = atan(answer);
+	case OP_ASIN:
+	  *x = asin(*x);
 	  break;
-    case INT:
-	  match(INT);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = floor(answer);
+	case OP_ACOS:
+	  *x = acos(*x);
 	  break;
-    case RND:
-	  match(RND);
-	  match(OPAREN);
-	  answer = expr();
-	  match(CPAREN);
-	  answer = floor(answer);
-	  if(answer > 1)
-		answer = fmod(rand(), answer);
-	  else
-	  {
-		if(answer < 0)
-		  srand( (unsigned) -answer);
-		answer = 0;
-	  }
+	case OP_ATAN:
+	  *x = atan(*x);
 	  break;
-    case VAL:
-	  match(VAL);
-	  match(OPAREN);
-	  str = stringexpr();
-	  match(CPAREN);
-	  if(str)
-	  {
-	    answer = strtod(str, 0);
-		free(str);
-	  }
-	  else
-		answer = 0;
+	case OP_INT:
+	  *x = floor(*x);
 	  break;
 	default:
-	  if(isstring(token))
-		seterror(ERR_TYPEMISMATCH);
-	  else
-	    seterror(ERR_SYNTAX);
-	  break;
-  }
-
-  while(token == SHRIEK)
-  {
-    match(SHRIEK);
-	answer = factorial(answer);
+	  return 0;
   }
 
-  return answer;
-}
-
-/*
-  get the value of a scalar variable from string
-  matches FLTID
-*/
-static double variable(void)
-{
-  VARIABLE *var;
-  char id[32];
-  int len;
-
-  getid(string, id, &len);
-  match(FLTID);
-  var = findvariable(id);
-  if(var)
-    return var->dval;
-  else
-  {
-	seterror(ERR_NOSUCHVARIABLE);
-	return 0.0;
-  }
+  return 1;
 }
 
 /*
-  get value of a dimensioned variable from string.
-  matches DIMFLTID
+  put a string literal in the program's pool.
+  Params: tok - index of the first QUOTE token
+		  n - number of adjacent literals, joined into one
+		  len - return pointer for the length of the string
+  Returns: offset of the string in the pool, -1 on out of memory
+  Notes: the literal is decoded once, here, and the same string
+		 is kept only once. newlines aren't allwed in literals, but
+		 blind concatenation across newlines is.
 */
-static double dimvariable(void)
+static int internliteral(mb_context *ctx, int tok, int n, int *len)
 {
-  DIMVAR *dimvar;
-  char id[32];
-  int len;
-  int index[5];
-  double *answer;
-
-  getid(string, id, &len);
-  match(DIMFLTID);
-  dimvar = finddimvar(id);
-  if(!dimvar)
-  {
-    seterror(ERR_NOSUCHVARIABLE);
-	return 0.0;
-  }
+  mb_program *prog = ctx->build;
+  char *temp;
+  char *str;
+  int size = 1;
+  int i;
+  unsigned h;
 
-  if(dimvar)
+  for(i=tok;i<tok+n;i++)
+	size += prog->tokens[i].len - 2;
+  if(prog->poolsize + size > prog->maxpool)
   {
-    switch(dimvar->ndims)
+	temp = realloc(prog->pool, (prog->poolsize + size) * 2);
+	if(!temp)
 	{
-	  case 1:
-	    index[0] = (int) expr();
-		answer = getdimvar(dimvar, index[0]);
-		break;
-      case 2:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1]);
-		break;
-	  case 3:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2]);
-		break;
-	  case 4:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		match(COMMA);
-		index[3] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2], index[3]);
-		break;
-	  case 5:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		match(COMMA);
-		index[3] = (int) expr();
-		match(COMMA);
-		index[4] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2], index[3], index[4]);
-		break;
-
+	  seterror(ctx, ERR_OUTOFMEMORY);
+	  return -1;
 	}
-
-	match(CPAREN);
+	prog->pool = temp;
+	prog->maxpool = (prog->poolsize + size) * 2;
   }
+  if(ctx->nlits * 2 >= ctx->lithashsize)
+	if(rehashliterals(ctx) == -1)
+	{
+	  seterror(ctx, ERR_OUTOFMEMORY);
+	  return -1;
+	}
 
-  if(answer)
-	return *answer;
+  str = prog->pool + prog->poolsize;
+  *str = 0;
+  for(i=tok;i<tok+n;i++)
+	mystrgrablit(str + strlen(str), prog->tokens[i].str);
+  *len = strlen(str);
 
-  return 0.0;
+  h = hashid(str, *len) & (ctx->lithashsize - 1);
+  while(ctx->lithash[h] != -1)
+  {
+	if(!strcmp(prog->pool + ctx->lithash[h], str))
+	  return ctx->lithash[h];
+	h = (h + 1) & (ctx->lithashsize - 1);
+  }
+  ctx->lithash[h] = prog->poolsize;
+  ctx->nlits++;
+  prog->poolsize += *len + 1;
 
+  return ctx->lithash[h];
 }
 
 /*
-  find a scalar variable invariables list
-  Params: id - id to get
-  Returns: pointer to that entry, 0 on fail
+  double the size of the literal hash table.
+  Returns: 0 on success, -1 on out of memory
 */
-static VARIABLE *findvariable(const char *id)
+static int rehashliterals(mb_context *ctx)
 {
+  const char *pool = ctx->build->pool;
+  int *temp;
+  int size;
   int i;
+  unsigned h;
+
+  size = ctx->lithashsize ? ctx->lithashsize * 2 : 64;
+  temp = malloc(size * sizeof(int));
+  if(!temp)
+	return -1;
+  for(i=0;i<size;i++)
+	temp[i] = -1;
+  for(i=0;i<ctx->lithashsize;i++)
+  {
+	if(ctx->lithash[i] == -1)
+	  continue;
+	h = hashid(pool + ctx->lithash[i], strlen(pool + ctx->lithash[i])) & (size - 1);
+	while(temp[h] != -1)
+	  h = (h + 1) & (size - 1);
+	temp[h] = ctx->lithash[i];
+  }
+
+  if(ctx->lithash)
+	free(ctx->lithash);
+  ctx->lithash = temp;
+  ctx->lithashsize = size;
 
-  for(i=0;i<nvariables;i++)
-	if(!strcmp(variables[i].id, id))
-	  return &variables[i];
   return 0;
 }
 
 /*
-  get a dimensioned array by name
-  Params: id (includes opening parenthesis)
-  Returns: pointer to array entry or 0 on fail
+  get a dimensioned array
+  Params: id - identifier handle of the array
+  Returns: pointer to array entry or 0 if not dimensioned
 */
-static DIMVAR *finddimvar(const char *id)
+static DIMVAR *finddimvar(mb_context *ctx, int id)
 {
-  int i;
-
-  for(i=0;i<ndimvariables;i++)
-	if(!strcmp(dimvariables[i].id, id))
-	  return &dimvariables[i];
+  if(ctx->dimvariables[id].ndims)
+	return &ctx->dimvariables[id];
   return 0;
 }
 
 /*
   dimension an array.
-  Params: id - the id of the array (include leading ()
+  Params: dv - the array's entry in the variable list
           ndims - number of dimension (1-5)
-		  ... - integers giving dimension size, 
+		  dims - the dimension sizes
+  Returns: dv, or 0 on out of memory
+  Notes: the first subscript varies fastest. The row strides are
+		 worked out here so element access needs no multiplies
+		 by the dimensions.
 */
-static DIMVAR *dimension(const char *id, int ndims, ...)
+static DIMVAR *dimension(mb_context *ctx, DIMVAR *dv, int ndims, const int *dims)
 {
-  DIMVAR *dv;
-  va_list vargs;
   int size = 1;
-  int oldsize = 1;
+  int oldsize;
   int i;
-  int dimensions[5];
   double *dtemp;
-  char **stemp;
+  STRSLOT *stemp;
 
   assert(ndims <= 5);
   if(ndims > 5)
 	return 0;
 
-  dv = finddimvar(id);
-  if(!dv)
-	dv = adddimvar(id);
-  if(!dv)
-  {
-    seterror(ERR_OUTOFMEMORY);
-	return 0;
-  }
-
-  if(dv->ndims)
-  {
-    for(i=0;i<dv->ndims;i++)
-	  oldsize *= dv->dim[i];
-  }
-  else
-	oldsize = 0;
-
-  va_start(vargs, ndims);
+  oldsize = dv->ndims ? dv->size : 0;
   for(i=0;i<ndims;i++)
-  {
-	dimensions[i] = va_arg(vargs, int);
-    size *= dimensions[i];
-  }
-  va_end(vargs);
+	size *= dims[i];
 
   switch(dv->type)
   {
     case FLTID:
-      dtemp = realloc(dv->dval, size * sizeof(double));
+	  dtemp = runrealloc(ctx, dv->dval, size * sizeof(double));
       if(dtemp)
+	  {
         dv->dval = dtemp;
+		for(i=oldsize;i<size;i++)
+		  dv->dval[i] = 0;
+	  }
 	  else
 	  {
-		seterror(ERR_OUTOFMEMORY);
+		seterror(ctx, ERR_OUTOFMEMORY);
 	    return 0;
 	  }
 	  break;
@@ -1701,28 +3724,28 @@ static DIMVAR *dimension(const char *id, int ndims, ...)
 	  if(dv->str)
 	  {
 	    for(i=size;i<oldsize;i++)
-		  if(dv->str[i])
+		  if(dv->str[i].len > SMALLSTRING)
 		  {
-			free(dv->str[i]);
-		    dv->str[i] = 0;
+			dropstring(ctx, dv->str[i].u.big);
+		    dv->str[i].len = 0;
 		  }
 	  }
-	  stemp = realloc(dv->str, size * sizeof(char *));
+	  stemp = runrealloc(ctx, dv->str, size * sizeof(STRSLOT));
 	  if(stemp)
 	  {
 		dv->str = stemp;
-	    for(i=oldsize;i<size;i++)
-		  dv->str[i] = 0;
+	    if(size > oldsize)
+		  memset(dv->str + oldsize, 0, (size - oldsize) * sizeof(STRSLOT));
 	  }
 	  else
 	  {
 		for(i=0;i<oldsize;i++)
-		  if(dv->str[i])
+		  if(dv->str[i].len > SMALLSTRING)
 		  {
-            free(dv->str[i]);
-		    dv->str[i] = 0;
+			dropstring(ctx, dv->str[i].u.big);
+		    dv->str[i].len = 0;
 		  }
-	    seterror(ERR_OUTOFMEMORY);
+		seterror(ctx, ERR_OUTOFMEMORY);
 		return 0;
 	  }
 	  break;
@@ -1730,9 +3753,13 @@ static DIMVAR *dimension(const char *id, int ndims, ...)
 	  assert(0);
   }
 
-  for(i=0;i<5;i++)
-	dv->dim[i] = dimensions[i];
+  for(i=0;i<ndims;i++)
+  {
+	dv->dim[i] = dims[i];
+	dv->stride[i] = i ? dv->stride[i-1] * dims[i-1] : 1;
+  }
   dv->ndims = ndims;
+  dv->size = size;
 
   return dv;
 }
@@ -1741,644 +3768,919 @@ static DIMVAR *dimension(const char *id, int ndims, ...)
   get the address of a dimensioned array element.
   works for both string and real arrays.
   Params: dv - the array's entry in variable list
-          ... - integers telling which array element to get
+		  subs - the subscripts, counting from 1, one per dimension
   Returns: the address of that element, 0 on fail
 */ 
-static void *getdimvar(DIMVAR *dv, ...)
+static void *getdimvar(mb_context *ctx, DIMVAR *dv, const double *subs)
 {
-  va_list vargs;
-  int index[5];
   int i;
-  void *answer = 0;
+  int offset = 0;
 
-  va_start(vargs, dv);
   for(i=0;i<dv->ndims;i++)
   {
-	index[i] = va_arg(vargs, int);
-    index[i]--;
-  }
-  va_end(vargs);
-
-  for(i=0;i<dv->ndims;i++)
-    if(index[i] >= dv->dim[i] || index[i] < 0)
+	if(subs[i] < 1 || subs[i] >= dv->dim[i] + 1.0)
 	{
-	  seterror(ERR_BADSUBSCRIPT);
+	  seterror(ctx, ERR_BADSUBSCRIPT);
 	  return 0;
 	}
+	offset += ((int) subs[i] - 1) * dv->stride[i];
+  }
 
   if(dv->type == FLTID)
+	return &dv->dval[offset];
+  return &dv->str[offset];
+}
+
+/*
+  dimension an array from the number stack.
+  Params: id - identifier handle of the array
+		  ndims - number of dimensions
+		  dims - the dimensions
+  Returns: the array, 0 on fail
+*/
+static DIMVAR *dimarray(mb_context *ctx, int id, int ndims, const double *dims)
+{
+  DIMVAR *dimvar;
+  int idims[5];
+  int i;
+
+  for(i=0;i<ndims;i++)
   {
-    switch(dv->ndims)
+	if(dims[i] < 0 || dims[i] != (int) dims[i])
 	{
-      case 1:
-	  	answer = &dv->dval[ index[0] ]; 
-	    break;
-      case 2:
-	    answer = &dv->dval[ index[1] * dv->dim[0] 
-			+ index[0] ];
-		break;
-      case 3:
-	    answer = &dv->dval[ index[2] * (dv->dim[0] * dv->dim[1]) 
-			+ index[1] * dv->dim[0] 
-			+ index[0] ];
-	    break;
-      case 4:
-		answer = &dv->dval[ index[3] * (dv->dim[0] + dv->dim[1] + dv->dim[2]) 
-			+ index[2] * (dv->dim[0] * dv->dim[1]) 
-			+ index[1] * dv->dim[0] 
-			+ index[0] ];
-      case 5:
-		answer = &dv->dval[ index[4] * (dv->dim[0] + dv->dim[1] + dv->dim[2] + dv->dim[3])
-          + index[3] * (dv->dim[0] + dv->dim[1] + dv->dim[2])
-		  + index[2] * (dv->dim[0] + dv->dim[1])
-		  + index[1] * dv->dim[0]
-		  + index[0] ];
+	  seterror(ctx, ERR_BADSUBSCRIPT);
+	  return 0;
+	}
+	idims[i] = (int) dims[i];
+  }
+
+  dimvar = dimension(ctx, &ctx->dimvariables[id], ndims, idims);
+  if(dimvar == 0)
+	seterror(ctx, ERR_OUTOFMEMORY);
+
+  return dimvar;
+}
+
+/*
+  get the address of an array element from the number stack.
+  Params: id - identifier handle of the array
+		  nsubs - number of subscripts
+		  subs - the subscripts
+  Returns: the address of the element, 0 on fail
+*/
+static void *getelement(mb_context *ctx, int id, int nsubs, const double *subs)
+{
+  DIMVAR *dimvar;
+
+  dimvar = finddimvar(ctx, id);
+  if(!dimvar)
+  {
+	seterror(ctx, ERR_NOSUCHVARIABLE);
+	return 0;
+  }
+  if(nsubs != dimvar->ndims)
+  {
+	seterror(ctx, ERR_SYNTAX);
+	return 0;
+  }
+
+  return getdimvar(ctx, dimvar, subs);
+}
+
+/*
+  set an element of an array initialiser list.
+  Params: id - identifier handle of the array
+		  i - index of the element
+		  x - value for a real array
+		  sv - value for a string array, taken off the stack
+*/
+static void initarray(mb_context *ctx, int id, int i, double x, STRVAL *sv)
+{
+  DIMVAR *dimvar;
+
+  dimvar = finddimvar(ctx, id);
+  if(i >= dimvar->size)
+  {
+	seterror(ctx, ERR_TOOMANYINITS);
+	if(sv)
+	  dropstring(ctx, sv->mem);
+	return;
+  }
+
+  switch(dimvar->type)
+  {
+	case FLTID:
+	  dimvar->dval[i] = x;
+	  break;
+	case STRID:
+	  storestring(ctx, &dimvar->str[i], sv);
 	  break;
+  }
+}
+
+/*
+  the RND function
+  Params: x - range, or negative to seed the generator
+  Returns: random integer 0 to x-1, 0 if seeding
+*/
+static double rnd(mb_context *ctx, double x)
+{
+  x = floor(x);
+  if(x > 1)
+	return fmod(myrand(ctx), x);
+  if(x < 0)
+	ctx->seed = (unsigned long) -x;
+  return 0;
+}
+
+/*
+  random number generator, the one given in the ANSI standard
+  but kept per interpreter, so runs on other threads don't disturb it.
+  Returns: random integer 0 to 2^30-1
+  Notes: two draws are combined to give thirty bits.
+*/
+static long myrand(mb_context *ctx)
+{
+  long answer;
+
+  ctx->seed = (ctx->seed * 1103515245UL + 12345) & 0xFFFFFFFFUL;
+  answer = (long) ((ctx->seed >> 16) & 0x7FFF) << 15;
+  ctx->seed = (ctx->seed * 1103515245UL + 12345) & 0xFFFFFFFFUL;
+  answer |= (long) ((ctx->seed >> 16) & 0x7FFF);
+
+  return answer;
+}
+
+/*
+  read a number from the input.
+  Params: x - return pointer for the number
+  Returns: 0 on success, -1 on end of input
+  Notes: characters which can't start a number are skipped.
+*/
+static int inputnumber(mb_context *ctx, double *x)
+{
+  if(ctx->inputflush)
+	flushoutput(ctx, 1);
+  while(!readnumber(ctx, x))
+  {
+	if(nextchar(ctx) == EOF)
+	{
+	  seterror(ctx, ERR_EOF);
+	  return -1;
 	}
   }
-  else if(dv->type == STRID)
+  return 0;
+}
+
+/*
+  read one number from the input, as fscanf("%lf") does.
+  Params: x - return pointer for the number
+  Returns: 1 if a number was read, else 0
+  Notes: takes the characters which could be part of a number and
+		 converts them with parsenumber(), or cstrtod(), so doesn't
+		 depend on the locale. Leading zeros are dropped, and past
+		 MAXDIGITS significant digits the rest are dropped too, with
+		 the exponent adjusted and a 1 added if any was non-zero to
+		 keep the rounding right. So a field of any length is read
+		 as one number.
+*/
+static int readnumber(mb_context *ctx, double *x)
+{
+  char digits[MAXDIGITS];
+  char buff[MAXDIGITS + 32];
+  int len = 0;
+  int nsig = 0;           /* significant digits kept */
+  int ndigits = 0;        /* digits read */
+  int hex = 0;
+  int shift;              /* exponent step for one digit */
+  int dropped = 0;        /* a non-zero digit was dropped */
+  long adjust = 0;        /* exponent of the last digit kept */
+  long exponent = 0;
+  int expsign = 1;
+  int ch;
+
+  do
+	ch = nextchar(ctx);
+  while(isspace(ch));
+
+  if(ch == '+' || ch == '-')
+  {
+	buff[len++] = (char) ch;
+	ch = nextchar(ctx);
+  }
+  if(ch == 'i' || ch == 'I' || ch == 'n' || ch == 'N')
+  {
+	if(!readspecial(ctx, ch, x))
+	  return 0;
+	if(len && buff[0] == '-')
+	  *x = -*x;
+	return 1;
+  }
+  if(ch == '0')
   {
-	switch(dv->ndims)
+	ch = nextchar(ctx);
+	if(ch == 'x' || ch == 'X')
 	{
-      case 1:
-	  	answer = &dv->str[ index[0] ]; 
-	    break;
-      case 2:
-	    answer = &dv->str[ index[1] * dv->dim[0] 
-			+ index[0] ];
-		break;
-      case 3:
-	    answer = &dv->str[ index[2] * (dv->dim[0] * dv->dim[1]) 
-			+ index[1] * dv->dim[0] 
-			+ index[0] ];
-	    break;
-      case 4:
-		answer = &dv->str[ index[3] * (dv->dim[0] + dv->dim[1] + dv->dim[2]) 
-			+ index[2] * (dv->dim[0] * dv->dim[1]) 
-			+ index[1] * dv->dim[0] 
-			+ index[0] ];
-      case 5:
-		answer = &dv->str[ index[4] * (dv->dim[0] + dv->dim[1] + dv->dim[2] + dv->dim[3])
-          + index[3] * (dv->dim[0] + dv->dim[1] + dv->dim[2])
-		  + index[2] * (dv->dim[0] + dv->dim[1])
-		  + index[1] * dv->dim[0]
-		  + index[0] ];
-	  break;
+	  buff[len++] = '0';
+	  buff[len++] = 'x';
+	  ch = nextchar(ctx);
+	  hex = 1;
 	}
+	else
+	  ndigits++;
   }
+  shift = hex ? 4 : 1;
 
-  return answer;
+  while(hex ? isxdigit(ch) : isdigit(ch))
+  {
+	ndigits++;
+	if(nsig == 0 && ch == '0')
+	  ;
+	else if(nsig < MAXDIGITS)
+	  digits[nsig++] = (char) ch;
+	else
+	{
+	  if(adjust < MAXEXPONENT)
+		adjust += shift;
+	  if(ch != '0')
+		dropped = 1;
+	}
+	ch = nextchar(ctx);
+  }
+  if(ch == '.')
+  {
+	ch = nextchar(ctx);
+	while(hex ? isxdigit(ch) : isdigit(ch))
+	{
+	  ndigits++;
+	  if(nsig < MAXDIGITS && (nsig > 0 || ch != '0'))
+		digits[nsig++] = (char) ch;
+	  else if(nsig == MAXDIGITS)
+	  {
+		if(ch != '0')
+		  dropped = 1;
+		ch = nextchar(ctx);
+		continue;
+	  }
+	  if(adjust > -MAXEXPONENT)
+		adjust -= shift;
+	  ch = nextchar(ctx);
+	}
+  }
+  if(ndigits && (hex ? (ch == 'p' || ch == 'P') : (ch == 'e' || ch == 'E')))
+  {
+	ch = nextchar(ctx);
+	if(ch == '+' || ch == '-')
+	{
+	  if(ch == '-')
+		expsign = -1;
+	  ch = nextchar(ctx);
+	}
+	while(isdigit(ch))
+	{
+	  if(exponent < MAXEXPONENT)
+		exponent = exponent * 10 + (ch - '0');
+	  ch = nextchar(ctx);
+	}
+  }
+  if(ch != EOF)
+	backchar(ctx, ch);
+
+  if(!ndigits)
+	return 0;
+
+  if(nsig == 0)
+	buff[len++] = '0';
+  memcpy(buff + len, digits, nsig);
+  len += nsig;
+  if(dropped)
+  {
+	buff[len++] = '1';
+	adjust -= shift;
+  }
+  len += sprintf(buff + len, "%c%ld", hex ? 'p' : 'e', expsign * exponent + adjust);
+
+  if(parsenumber(buff, len, x) == -1)
+	cstrtod(buff, len, x);
+  return 1;
 }
 
 /*
-  add a real varaible to our variable list
-  Params: id - id of varaible to add.
-  Returns: pointer to new entry in table
+  read an infinity or a NaN, as fscanf("%lf") does.
+  Params: ch - the first character, i or n
+		  x - return pointer for the number
+  Returns: 1 if one was read, else 0
+  Notes: "inf", "infinity" and "nan" are taken in any case. As
+		 with fscanf(), characters which matched before a mismatch
+		 are lost.
 */
-static VARIABLE *addfloat(const char *id)
+static int readspecial(mb_context *ctx, int ch, double *x)
 {
-   VARIABLE *vars;
+  const char *word;
+  int i = 0;
 
-  vars = realloc(variables, (nvariables + 1) * sizeof(VARIABLE));
-  if(vars)
+  word = (ch == 'i' || ch == 'I') ? "infinity" : "nan";
+  while(word[i] && tolower(ch) == word[i])
   {
-	variables = vars;
-    strcpy(variables[nvariables].id, id);
-	variables[nvariables].dval = 0;
-	variables[nvariables].sval = 0;
-	nvariables++;
-	return &variables[nvariables-1];
+	i++;
+	ch = nextchar(ctx);
   }
-  else
-	seterror(ERR_OUTOFMEMORY);
+  if(ch != EOF)
+	backchar(ctx, ch);
+  if(i != 3 && i != 8)
+	return 0;
+  cstrtod(word, 3, x);
 
-  return 0; 
+  return 1;
 }
 
 /*
-  add a string variable to table.
-  Params: id - id of variable to get (including trailing $)
-  Retruns: pointer to new entry in table, 0 on fail.       
+  read a line from the input.
+  Params: sv - set to the line
+  Returns: 0 on success, -1 on fail
+  Notes: the line may hold nuls. A line wholly in memory is
+		 borrowed where it is, which is safe as INPUT stores it
+		 before reading any more.
 */
-static VARIABLE *addstring(const char *id)
+static int inputstring(mb_context *ctx, STRVAL *sv)
 {
-  VARIABLE *vars;
+  char buff[1024];
+  const char *nl;
+  STRING *str;
+  size_t avail;
+  int len = 0;
+  int ch = 0;
+
+  if(ctx->inputflush)
+	flushoutput(ctx, 1);
+
+  avail = ctx->inend - ctx->inptr;
+  if(avail > sizeof(buff) - 1)
+	avail = sizeof(buff) - 1;
+  if(avail && (nl = memchr(ctx->inptr, '\n', avail)) != 0)
+  {
+	sv->str = ctx->inptr;
+	sv->len = nl - ctx->inptr;
+	sv->mem = 0;
+	ctx->inptr = nl + 1;
+	return 0;
+  }
 
-  vars = realloc(variables, (nvariables + 1) * sizeof(VARIABLE));
-  if(vars)
+  while(len < (int) sizeof(buff) - 1 && (ch = nextchar(ctx)) != EOF)
+  {
+	buff[len++] = (char) ch;
+	if(ch == '\n')
+	  break;
+  }
+  if(len == 0)
+  {
+	seterror(ctx, ERR_EOF);
+	return -1;
+  }
+  if(ch != '\n')
   {
-	variables = vars;
-    strcpy(variables[nvariables].id, id);
-	variables[nvariables].sval = 0;
-	variables[nvariables].dval = 0;
-	nvariables++;
-	return &variables[nvariables-1];
+	seterror(ctx, ERR_SYNTAX);
+	return -1;
+  }
+  str = newstring(ctx, buff, len - 1);
+  if(!str)
+  {
+	seterror(ctx, ERR_OUTOFMEMORY);
+	return -1;
   }
+  sv->str = str->str;
+  sv->len = str->len;
+  sv->mem = str;
+
+  return 0;
+}
+
+/*
+  get the next character of input.
+  Returns: the character, EOF at the end of the input
+*/
+static int nextchar(mb_context *ctx)
+{
+  if(ctx->inptr < ctx->inend)
+	return (unsigned char) *ctx->inptr++;
+  if(ctx->fpin)
+	return getc(ctx->fpin);
+  return fillinput(ctx);
+}
+
+/*
+  put back the character nextchar() gave.
+  Params: ch - the character, not EOF
+*/
+static void backchar(mb_context *ctx, int ch)
+{
+  if(ctx->fpin)
+	ungetc(ch, ctx->fpin);
   else
-	seterror(ERR_OUTOFMEMORY);
+	ctx->inptr--;
+}
+
+/*
+  ask the reader for more input.
+  Returns: the first new character, EOF at the end of the input
+  Notes: output is written out first, in case the reader waits
+		 on a user.
+*/
+static int fillinput(mb_context *ctx)
+{
+  int len;
+
+  if(!ctx->reader)
+	return EOF;
+  flushoutput(ctx, 1);
+  len = (*ctx->reader)(ctx->readarg, ctx->inblock, INBLOCK);
+  if(len <= 0)
+	return EOF;
+  ctx->inptr = ctx->inblock;
+  ctx->inend = ctx->inblock + len;
 
-  return 0;
+  return (unsigned char) *ctx->inptr++;
 }
 
 /*
-  add a new array to our symbol table.
-  Params: id - id of array (include leading ()
-  Returns: pointer to new entry, 0 on fail.
+  write to the output buffer.
+  Params: str - characters to write
+		  len - number of characters
+  Notes: when the buffer is full it is written out, and long
+		 strings go straight to the stream or writer. Output to
+		 memory which doesn't fit is counted and dropped.
 */
-static DIMVAR *adddimvar(const char *id)
+static void writeoutput(mb_context *ctx, const char *str, int len)
 {
-  DIMVAR *vars;
+  size_t room = ctx->outsize - ctx->outlen;
+
+  if((size_t) len <= room)
+  {
+	memcpy(ctx->outbuf + ctx->outlen, str, len);
+	ctx->outlen += len;
+	return;
+  }
+  if(ctx->outmem)
+  {
+	memcpy(ctx->outbuf + ctx->outlen, str, room);
+	ctx->outlen += room;
+	ctx->outlost += len - room;
+	return;
+  }
 
-  vars = realloc(dimvariables, (ndimvariables + 1) * sizeof(DIMVAR));
-  if(vars)
+  flushoutput(ctx, 0);
+  if((size_t) len >= ctx->outsize)
   {
-    dimvariables = vars;
-	strcpy(dimvariables[ndimvariables].id, id);
-	dimvariables[ndimvariables].dval = 0;
-	dimvariables[ndimvariables].str = 0;
-	dimvariables[ndimvariables].ndims = 0;
-	dimvariables[ndimvariables].type = strchr(id, '$') ? STRID : FLTID;
-	ndimvariables++;
-	return &dimvariables[ndimvariables-1];
+	if(ctx->writer)
+	  (*ctx->writer)(ctx->writearg, str, len);
+	else if(ctx->fpout)
+	  fwrite(str, 1, len, ctx->fpout);
   }
   else
-	seterror(ERR_OUTOFMEMORY);
- 
-  return 0;
+  {
+	memcpy(ctx->outbuf, str, len);
+	ctx->outlen = len;
+  }
 }
 
 /*
-  high level string parsing function.
-  Returns: a malloced pointer, or 0 on error condition.
-  caller must free!
+  write out the output buffer.
+  Params: push - also flush the stream, so the output is seen now
+  Notes: output to memory is nul-terminated, and its length noted.
 */
-static char *stringexpr(void)
+static void flushoutput(mb_context *ctx, int push)
 {
-  char *left;
-  char *right;
-  char *temp;
-
-  switch(token)
+  if(ctx->outmem)
   {
-    case DIMSTRID:
-	  left = mystrdup(stringdimvar());
-	  break;
-    case STRID:
-      left = mystrdup(stringvar());
-	  break;
-	case QUOTE:
-	  left = stringliteral();
-	  break;
-	case CHRSTRING:
-	  left = chrstring();
-	  break;
-	case STRSTRING:
-	  left = strstring();
-	  break;
-	case LEFTSTRING:
-	  left = leftstring();
-	  break;
-	case RIGHTSTRING:
-	  left = rightstring();
-	  break;
-	case MIDSTRING:
-	  left = midstring();
-	  break;
-    case STRINGSTRING:
-	  left = stringstring();
-	  break;
-	default:
-	  if(!isstring(token))
-		seterror(ERR_TYPEMISMATCH);
-	  else
-	    seterror(ERR_SYNTAX);
-	  return mystrdup("");
+	if(ctx->outmemsize)
+	  ctx->outbuf[ctx->outlen] = 0;
+	ctx->outmemlen = ctx->outlen + ctx->outlost;
+	return;
   }
-
-  if(!left)
+  if(ctx->writer)
   {
-    seterror(ERR_OUTOFMEMORY);
-    return 0;
+	if(ctx->outlen)
+	  (*ctx->writer)(ctx->writearg, ctx->outbuf, (int) ctx->outlen);
   }
-
-  switch(token)
+  else if(ctx->fpout)
   {
-    case PLUS:
-	  match(PLUS);
-	  right = stringexpr();
-	  if(right)
-	  {
-	    temp = mystrconcat(left, right);
-	    free(right);
-		if(temp)
-		{
-		  free(left);
-          left = temp;
-		}
-		else
-		  seterror(ERR_OUTOFMEMORY);
-	  }
-	  else
-		seterror(ERR_OUTOFMEMORY);
-	  break;
-	default:
-	  return left;
+	if(ctx->outlen)
+	  fwrite(ctx->outbuf, 1, ctx->outlen, ctx->fpout);
+	if(push)
+	  fflush(ctx->fpout);
   }
+  ctx->outlen = 0;
+}
 
-  return left;
+/*
+  write an error message.
+  Params: msg - the message, with its newline
+  Notes: goes to the error writer if there is one, else fperr.
+*/
+static void writeerror(mb_context *ctx, const char *msg)
+{
+  if(ctx->errwriter)
+	(*ctx->errwriter)(ctx->errarg, msg, (int) strlen(msg));
+  else if(ctx->fperr)
+	fputs(msg, ctx->fperr);
 }
 
 /*
-  parse the CHR$ token
+  find out if a stream is interactive.
+  Params: fp - the stream
+  Returns: 1 if it is a terminal, else 0
+  Notes: without POSIX, only stdin and stdout are taken to be
+		 terminals.
 */
-static char *chrstring(void)
+static int isterminal(FILE *fp)
 {
-  double x;
-  char buff[6];
-  char *answer;
+  if(!fp)
+	return 0;
+#ifdef TERMINALS
+  return isatty(fileno(fp));
+#else
+  return fp == stdin || fp == stdout;
+#endif
+}
 
-  match(CHRSTRING);
-  match(OPAREN);
-  x = expr();
-  match(CPAREN);
+/*
+  the CHR$ function
+  Params: x - the character code
+  Returns: one character string, 0 on fail
+*/
+static STRING *chrstring(mb_context *ctx, double x)
+{
+  char ch;
+  STRING *answer;
 
-  buff[0] = (char) x;
-  buff[1] = 0;
-  answer = mystrdup(buff);
+  ch = (char) x;
+  answer = newstring(ctx, &ch, 1);
 
   if(!answer)
-	seterror(ERR_OUTOFMEMORY);
+	seterror(ctx, ERR_OUTOFMEMORY);
 
   return answer;
 }
 
 /*
-  parse the STR$ token
+  the STR$ function
+  Params: x - the number to convert
+  Returns: the number as a string, 0 on fail
 */
-static char *strstring(void)
+static STRING *strstring(mb_context *ctx, double x)
 {
-  double x;
   char buff[64];
-  char *answer;
-
-  match(STRSTRING);
-  match(OPAREN);
-  x = expr();
-  match(CPAREN);
+  STRING *answer;
 
-  sprintf(buff, "%g", x);
-  answer = mystrdup(buff);
+  answer = newstring(ctx, buff, formatnumber(buff, x));
   if(!answer)
-	seterror(ERR_OUTOFMEMORY);
+	seterror(ctx, ERR_OUTOFMEMORY);
   return answer;
 }
 
 /*
-  parse the LEFT$ token
+  the LEFT$ function
+  Params: sv - the string, replaced by the result
+		  x - number of characters
+  Notes: the result is the head of the string, so is never copied.
 */
-static char *leftstring(void)
+static void leftstring(mb_context *ctx, STRVAL *sv, double x)
 {
-  char *str;
-  double x;
-  char *answer;
-
-  match(LEFTSTRING);
-  match(OPAREN);
-  str = stringexpr();
-  if(!str)
-	return 0;
-  match(COMMA);
-  x = expr();
-  match(CPAREN);
-
-  if(x > strlen(str))
-	return str;
+  if(x > sv->len)
+	return;
   if(x < 0)
   {
-    seterror(ERR_ILLEGALOFFSET);
-    return str;
+	seterror(ctx, ERR_ILLEGALOFFSET);
+	return;
   }
-  str[(int) x] = 0;
-  answer = mystrdup(str);
-  free(str);
-  if(!answer)
-	seterror(ERR_OUTOFMEMORY);
-  return answer;
+
+  sv->len = (int) x;
 }
 
 /*
-  parse the RIGHT$ token
+  the RIGHT$ function
+  Params: sv - the string, replaced by the result
+		  x - number of characters
+  Notes: the result is the tail of the string, so is never copied.
 */
-static char *rightstring(void)
+static void rightstring(mb_context *ctx, STRVAL *sv, double x)
 {
-  double x;
-  char *str;
-  char *answer;
-
-  match(RIGHTSTRING);
-  match(OPAREN);
-  str = stringexpr();
-  if(!str)
-	return 0;
-  match(COMMA);
-  x = expr();
-  match(CPAREN);
-
-  if( x > strlen(str))
-	return str;
-
+  if(x > sv->len)
+	return;
   if(x < 0)
   {
-    seterror(ERR_ILLEGALOFFSET);
-	return str;
+	seterror(ctx, ERR_ILLEGALOFFSET);
+	return;
   }
-  
-  answer = mystrdup( &str[strlen(str) - (int) x] );
-  free(str);
-  if(!answer)
-	seterror(ERR_OUTOFMEMORY);
-  return answer;
+
+  sv->str += sv->len - (int) x;
+  sv->len = (int) x;
 }
 
 /*
-  parse the MID$ token
+  the MID$ function
+  Params: sv - the string, replaced by the result
+		  x - first character, starting from 1
+		  len - number of characters
+  Notes: the result is part of the string, so is never copied.
 */
-static char *midstring(void)
+static void midstring(mb_context *ctx, STRVAL *sv, double x, double len)
 {
-  char *str;
-  double x;
-  double len;
-  char *answer;
-  char *temp;
-
-  match(MIDSTRING);
-  match(OPAREN);
-  str = stringexpr();
-  match(COMMA);
-  x = expr();
-  match(COMMA);
-  len = expr();
-  match(CPAREN);
-
-  if(!str)
-	return 0;
-
-  if( x > strlen(str) || len < 1)
-  {
-	free(str);
-	answer = mystrdup("");
-	if(!answer)
-	  seterror(ERR_OUTOFMEMORY);
-    return answer;
-  }
-  
-  if(x < 1.0)
+  if( x > sv->len || len < 1)
   {
-    seterror(ERR_ILLEGALOFFSET);
-	return str;
+	dropstring(ctx, sv->mem);
+	sv->str = "";
+	sv->len = 0;
+	sv->mem = 0;
+	return;
   }
 
-  temp = &str[(int) x-1];
-
-  answer = malloc( (size_t) len + 1);
-  if(!answer)
+  if(x < 1.0)
   {
-    seterror(ERR_OUTOFMEMORY);
-	return str;
+	seterror(ctx, ERR_ILLEGALOFFSET);
+	return;
   }
-  strncpy(answer, temp, (size_t) len);
-  answer[(int) len] = 0;
-  free(str);
 
-  return answer;
+  sv->str += (int) x - 1;
+  sv->len -= (int) x - 1;
+  if(len < sv->len)
+	sv->len = (int) len;
 }
 
 /*
-  parse the string$ token
+  the STRING$ function
+  Params: x - number of repeats
+		  sv - the string to repeat, replaced by the result
 */
-static char *stringstring(void)
+static void stringstring(mb_context *ctx, double x, STRVAL *sv)
 {
-  double x;
-  char *str;
-  char *answer;
-  int len;
+  STRING *answer;
   int N;
   int i;
 
-  match(STRINGSTRING);
-  match(OPAREN);
-  x = expr();
-  match(COMMA);
-  str = stringexpr();
-  match(CPAREN);
-
-  if(!str)
-	return 0;
-
   N = (int) x;
 
   if(N < 1)
   {
-    free(str);
-	answer = mystrdup("");
-	if(!answer)
-	  seterror(ERR_OUTOFMEMORY);
-	return answer;
+	dropstring(ctx, sv->mem);
+	sv->str = "";
+	sv->len = 0;
+	sv->mem = 0;
+	return;
   }
 
-  len = strlen(str);
-  answer = malloc( N * len + 1 );
+  answer = newstring(ctx, 0, N * sv->len);
   if(!answer)
   {
-    free(str);
-	seterror(ERR_OUTOFMEMORY);
-	return 0;
+	seterror(ctx, ERR_OUTOFMEMORY);
+	return;
   }
   for(i=0; i < N; i++)
   {
-    strcpy(answer + len * i, str);
+	memcpy(answer->str + sv->len * i, sv->str, sv->len);
   }
-  free(str);
-
-  return answer;
+  dropstring(ctx, sv->mem);
+  sv->str = answer->str;
+  sv->len = answer->len;
+  sv->mem = answer;
 }
 
 /*
-  read a dimensioned string variable from input.
-  Returns: pointer to string (not malloced) 
+  the VAL function
+  Params: sv - the string
+  Returns: the number at the start of the string
 */
-static char *stringdimvar(void)
+static double valstring(mb_context *ctx, const STRVAL *sv)
 {
-  char id[32];
-  int len;
-  DIMVAR *dimvar;
-  char **answer;
-  int index[5];
-
-  getid(string, id, &len);
-  match(DIMSTRID);
-  dimvar = finddimvar(id);
+  double answer;
 
-  if(dimvar)
+  if(parsenumber(sv->str, sv->len, &answer) != -1)
+	return answer;
+  if(cstrtod(sv->str, sv->len, &answer) == -1)
   {
-    switch(dimvar->ndims)
-	{
-	  case 1:
-	    index[0] = (int) expr();
-		answer = getdimvar(dimvar, index[0]);
-		break;
-      case 2:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1]);
-		break;
-	  case 3:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2]);
-		break;
-	  case 4:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		match(COMMA);
-		index[3] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2], index[3]);
-		break;
-	  case 5:
-		index[0] = (int) expr();
-		match(COMMA);
-		index[1] = (int) expr();
-		match(COMMA);
-		index[2] = (int) expr();
-		match(COMMA);
-		index[3] = (int) expr();
-		match(COMMA);
-		index[4] = (int) expr();
-		answer = getdimvar(dimvar, index[0], index[1], index[2], index[3], index[4]);
-		break;
+	seterror(ctx, ERR_OUTOFMEMORY);
+	return 0;
+  }
 
-	}
+  return answer;
+}
+
+/*
+  get a string off the stack to keep in a variable.
+  Params: sv - the string
+  Returns: string holding the characters, 0 on out of memory
+  Notes: the stack's reference is handed over. A string which is
+		 all of the stack's string is shared, so assignment doesn't
+		 copy. Part of a string is cut down where it is if nothing
+		 else holds it, otherwise copied, as is a borrowed string.
+*/
+static STRING *takestring(mb_context *ctx, STRVAL *sv)
+{
+  STRING *answer;
 
-	match(CPAREN);
+  answer = sv->mem;
+  if(answer && sv->str == answer->str && sv->len == answer->len)
+	return answer;
+  if(answer && answer->refs == 1)
+  {
+	if(sv->str != answer->str)
+	  memmove(answer->str, sv->str, sv->len);
+	answer->len = sv->len;
+	answer->str[answer->len] = 0;
+	return answer;
   }
-  else
-	seterror(ERR_NOSUCHVARIABLE);
 
-  if(!errorflag)
-	if(*answer)
-      return *answer;
-	 
-  return "";
+  answer = newstring(ctx, sv->str, sv->len);
+  if(!answer)
+	seterror(ctx, ERR_OUTOFMEMORY);
+  dropstring(ctx, sv->mem);
+  return answer;
 }
 
 /*
-  parse a string variable.
-  Returns: pointer to string (not malloced) 
+  store a string from the stack in a variable or array element.
+  Params: slot - the variable or element
+		  sv - the string, taken off the stack
+  Returns: 0 on success, -1 on out of memory
+  Notes: a short string is copied into the slot itself, so needs
+		 no block of its own, a long one is shared if it can be.
+		 The string may be a view of the slot, which is why the
+		 old value goes last.
 */
-static char *stringvar(void)
+static int storestring(mb_context *ctx, STRSLOT *slot, STRVAL *sv)
 {
-  char id[32];
-  int len;
-  VARIABLE *var;
+  STRING *old;
+  STRING *str;
 
-  getid(string, id, &len);
-  match(STRID);
-  var = findvariable(id);
-  if(var)
+  old = slot->len > SMALLSTRING ? slot->u.big : 0;
+  if(sv->len <= SMALLSTRING)
+  {
+	memmove(slot->u.small, sv->str, sv->len);
+	slot->u.small[sv->len] = 0;
+	dropstring(ctx, sv->mem);
+  }
+  else
   {
-    if(var->sval)
-	  return var->sval;
-	return "";
+	str = takestring(ctx, sv);
+	if(!str)
+	  return -1;
+	slot->u.big = str;
   }
-  seterror(ERR_NOSUCHVARIABLE);
-  return "";
+  slot->len = sv->len;
+  dropstring(ctx, old);
+
+  return 0;
 }
 
 /*
-  parse a string literal
-  Returns: malloced string literal
-  Notes: newlines aren't allwed in literals, but blind
-         concatenation across newlines is. 
+  append strings to a variable, LET A$ = A$ + ...
+  Params: slot - the variable
+		  strs - the strings to append
+		  n - number of strings
+  Returns: 0 on success, -1 on out of memory
+  Notes: a long string grows by doubling, so building a string a
+		 piece at a time copies each character a bounded number
+		 of times. The pieces may be views of the variable itself,
+		 which is why they are copied before the old string goes.
+		 A string held elsewhere as well is copied, not changed.
 */
-static char *stringliteral(void)
+static int appendstring(mb_context *ctx, STRSLOT *slot, const STRVAL *strs, int n)
 {
-  int len = 1;
-  char *answer = 0;
-  char *temp;
-  char *substr;
-  char *end;
+  STRING *old = 0;
+  STRING *answer = 0;
+  char *dest;
+  int len;
+  int refs = 1;
+  int i;
 
-  while(token == QUOTE)
+  len = slot->len;
+  for(i=0;i<n;i++)
+	len += strs[i].len;
+  if(slot->len > SMALLSTRING)
   {
-    while(isspace(*string))
-	  string++;
+	old = slot->u.big;
+	for(i=0;i<n;i++)
+	  if(strs[i].mem == old)
+		refs++;
+  }
 
-    end = mystrend(string, '"');
-    if(end)
+  if(len <= SMALLSTRING)
+	dest = slot->u.small;
+  else
+  {
+	answer = old;
+	if(!old || len > old->cap || old->refs != refs)
 	{
-      len = end - string;
-      substr = malloc(len);
-	  if(!substr)
-	  {
-	    seterror(ERR_OUTOFMEMORY);
-	    return answer;
-	  }
-	  mystrgrablit(substr, string);
-	  if(answer)
+	  answer = runalloc(ctx, STRINGSIZE(len * 2));
+	  if(!answer)
 	  {
-		temp = mystrconcat(answer, substr);
-	    free(substr);
-		free(answer);
-		answer = temp;
-		if(!answer)
-		{
-	      seterror(ERR_OUTOFMEMORY);
-		  return answer;
-		}
+		seterror(ctx, ERR_OUTOFMEMORY);
+		return -1;
 	  }
-	  else
-	    answer = substr;
-	  string = end;
-	}
-	else
-	{
-	  seterror(ERR_SYNTAX);
-	  return answer;
+	  answer->cap = len * 2;
+	  answer->refs = 1;
+	  memcpy(answer->str, SLOTCHARS(slot), slot->len);
 	}
+	dest = answer->str;
+	answer->len = len;
+  }
 
-	match(QUOTE);
+  for(i=0;i<n;i++)
+  {
+	memcpy(dest + slot->len, strs[i].str, strs[i].len);
+	slot->len += strs[i].len;
   }
+  dest[len] = 0;
 
-  return answer;
+  if(len > SMALLSTRING && answer != old)
+  {
+	dropstring(ctx, old);
+	slot->u.big = answer;
+  }
+  return 0;
+}
+
+/*
+  apply a relational operator to two numbers
+  Params: left - left operand
+		  right - right operand
+		  rop - the operator
+  Returns: 1 if true, else 0
+*/
+static int numcompare(double left, double right, int rop)
+{
+  switch(rop)
+  {
+	case ROP_EQ:
+	  return (left == right) ? 1 : 0;
+	case ROP_NEQ:
+	  return (left != right) ? 1 : 0;
+	case ROP_LT:
+	  return (left < right) ? 1 : 0;
+	case ROP_LTE:
+	  return (left <= right) ? 1 : 0;
+	case ROP_GT:
+	  return (left > right) ? 1 : 0;
+	case ROP_GTE:
+	  return (left >= right) ? 1 : 0;
+	default:
+	  return 0;
+  }
+}
+
+/*
+  apply a relational operator to two strings
+  Params: left - left operand
+		  right - right operand
+		  rop - the operator
+  Returns: 1 if true, else 0
+*/
+static int strcompare(const STRVAL *left, const STRVAL *right, int rop)
+{
+  int cmp;
+
+  cmp = memcmp(left->str, right->str, left->len < right->len ? left->len : right->len);
+  if(cmp == 0)
+	cmp = left->len - right->len;
+  switch(rop)
+  {
+	case ROP_EQ:
+	  return cmp == 0 ? 1 : 0;
+	case ROP_NEQ:
+	  return cmp == 0 ? 0 : 1;
+	case ROP_LT:
+	  return cmp < 0 ? 1 : 0;
+	case ROP_LTE:
+	  return cmp <= 0 ? 1 : 0;
+	case ROP_GT:
+	  return cmp > 0 ? 1 : 0;
+	case ROP_GTE:
+	  return cmp >= 0 ? 1 : 0;
+	default:
+	  return 0;
+  }
 }
 
 /*
   check that we have a token of the passed type 
   (if not set the errorflag)
-  Move parser on to next token. Sets token and string.
+  Move parser on to next token. Sets token and curtok.
 */
-static void match(int tok)
+static void match(mb_context *ctx, int tok)
 {
-  if(token != tok)
+  if(ctx->token != tok)
   {
-	seterror(ERR_SYNTAX);
+	seterror(ctx, ERR_SYNTAX);
 	return;
   }
 
-  while(isspace(*string))
-	string++;
+  if(ctx->token == EOS)
+	return;
 
-  string += tokenlen(string, token);
-  token = gettoken(string);
-  if(token == ERROR)
-	seterror(ERR_SYNTAX);
+  ctx->curtok++;
+  ctx->token = ctx->curtok->type;
+  if(ctx->token == ERROR)
+	seterror(ctx, ctx->curtok->id);
 }
 
 /*
@@ -2386,50 +4688,43 @@ static void match(int tok)
   Params: errorcode - the error.
   Notes: ignores error cascades
 */
-static void seterror(int errorcode)
+static void seterror(mb_context *ctx, int errorcode)
 {
-  if(errorflag == 0 || errorcode == 0)
-	errorflag = errorcode;
-}
-
-/*
-  get the next line number
-  Params: str - pointer to parse string
-  Returns: line no of next line, 0 if end
-  Notes: goes to newline, then finds
-         first line starting with a digit.
-*/
-static int getnextline(const char *str)
-{
-  while(*str)
-  {
-    while(*str && *str != '\n')
-	  str++;
-    if(*str == 0)
-	  return 0;
-    str++;
-    if(isdigit(*str))
-	  return atoi(str);
-  }
-  return 0;
+  if(ctx->errorflag == 0 || errorcode == 0)
+	ctx->errorflag = errorcode;
 }
 
 /*
   get a token from the string
   Params: str - string to read token from
-  Notes: ignores white space between tokens
+		  end - end of the line
+		  len - return pointer for the length of the token
+		  value - return pointer for the value of a VALUE
+  Returns: the token
+  Notes: each token is scanned once. A keyword is recognised by
+		 its name, so an identifier which starts with one is not
+		 mistaken for it. An identifier's length includes the $
+		 and ( qualifiers.
 */
-static int gettoken(const char *str)
+static int gettoken(const char *str, const char *end, int *len, double *value)
 {
-  while(isspace(*str))
-    str++;
+  const KEYWORD *kw;
+  int n;
 
+  *len = 1;
+  *value = 0.0;
   if(isdigit(*str))
+  {
+	*len = parsenumber(str, end - str, value);
+	if(*len == -1)
+	  *len = cstrtod(str, end - str, value);
     return VALUE;
+  }
  
   switch(*str)
   {
     case 0:
+	  *len = 0;
 	  return EOS;
     case '\n':
 	  return EOL;
@@ -2456,243 +4751,68 @@ static int gettoken(const char *str)
 	case '=':
 	  return EQUALS;
 	case '<':
-	  return LESS;
-	case '>':
-	  return GREATER;
-	default:
-	  if(!strncmp(str, "sin", 3) && !isalnum(str[3]))
-	    return SIN;
-      if(!strncmp(str, "cos", 3) && !isalnum(str[3]))
-	    return COS;
-	  if(!strncmp(str, "tan", 3) && !isalnum(str[3]))
-	    return TAN;
-	  if(!strncmp(str, "ln", 2) && !isalnum(str[2]))
-	    return LN;
-	  if(!strncmp(str, "pow", 3) && !isalnum(str[3]))
-	    return POW;
-	  if(!strncmp(str, "PI", 2) && !isalnum(str[2]))
-	    return PI;
-	  if(!strncmp(str, "sqrt", 4) && !isalnum(str[4]))
-		return SQRT;
-	  if(!strncmp(str, "PRINT", 5) && !isalnum(str[5]))
-		return PRINT;
-	  if(!strncmp(str, "LET", 3) && !isalnum(str[3]))
-		return LET;
-	  if(!strncmp(str, "DIM", 3) && !isalnum(str[3]))
-		return DIM;
-	  if(!strncmp(str, "IF", 2) && !isalnum(str[2]))
-		return IF;
-	  if(!strncmp(str, "THEN", 4) && !isalnum(str[4]))
-		return THEN;
-	  if(!strncmp(str, "AND", 3) && !isalnum(str[3]))
-		return AND;
-	  if(!strncmp(str, "OR", 2) && !isalnum(str[2]))
-		return OR;
-	  if(!strncmp(str, "GOTO", 4) && !isalnum(str[4]))
-		return GOTO;
-	  if(!strncmp(str, "INPUT", 5) && !isalnum(str[5]))
-		return INPUT;
-	  if(!strncmp(str, "REM", 3) && !isalnum(str[3]))
-		return REM;
-	  if(!strncmp(str, "FOR", 3) && !isalnum(str[3]))
-		return FOR;
-	  if(!strncmp(str, "TO", 2) && !isalnum(str[2]))
-		return TO;
-	  if(!strncmp(str, "NEXT", 4) && !isalnum(str[4]))
-		return NEXT;
-	  if(!strncmp(str, "STEP", 4) && !isalnum(str[4]))
-		return STEP;
-
-	  if(!strncmp(str, "MOD", 3) && !isalnum(str[3]))
-		return MOD;
-	  if(!strncmp(str, "ABS", 3) && !isalnum(str[3]))
-		return ABS;
-      if(!strncmp(str, "LEN", 3) && !isalnum(str[3]))
-		return LEN;
-      if(!strncmp(str, "ASCII", 5) && !isalnum(str[5]))
-		return ASCII;
-      if(!strncmp(str, "ASIN", 4) && !isalnum(str[4]))
-		return ASIN;
-      if(!strncmp(str, "ACOS", 4) && !isalnum(str[4]))
-		return ACOS;
-	  if(!strncmp(str, "ATAN", 4) && !isalnum(str[4]))
-		return ATAN;
-	  if(!strncmp(str, "INT", 3) && !isalnum(str[3]))
-		 return INT;
-      if(!strncmp(str, "RND", 3) && !isalnum(str[3]))
-		 return RND;
-      if(!strncmp(str, "VAL", 3) && !isalnum(str[3]))
-		 return VAL;
-
-	  if(!strncmp(str, "CHR$", 4))
-		return CHRSTRING;
-      if(!strncmp(str, "STR$", 4))
-		return STRSTRING;
-	  if(!strncmp(str, "LEFT$", 5))
-		return LEFTSTRING; 
-      if(!strncmp(str, "RIGHT$", 6))
-		return RIGHTSTRING;
-      if(!strncmp(str, "MID$", 4))
-		return MIDSTRING;
-      if(!strncmp(str, "STRING$", 7))
-		return STRINGSTRING;
-
-	  if(isalpha(*str))
-	  {
-		while(isalnum(*str))
-		  str++;
-		switch(*str)
-		{
-		  case '$':
-			return str[1] == '(' ? DIMSTRID : STRID;
-		  case '(':
-			return DIMFLTID;
-		  default:
-			return FLTID;
-		}
-	  }
-
-	  return ERROR;
-  } 
-}
-
-/*
-  get the length of a token.
-  Params: str - pointer to the string containing the token
-          token - the type of the token read
-  Returns: length of the token, or 0 for EOL to prevent
-           it being read past.
-*/
-static int tokenlen(const char *str, int token)
-{
-  int len = 0;
-  char buff[32];
-
-  switch(token)
-  {
-    case EOL:
-	  return 1;
-    case VALUE:
-	  getvalue(str, &len);
-	  return len;
-	case DIMSTRID:
-	case DIMFLTID:
-	case STRID:
-	  getid(str, buff, &len);
-	  return len;
-	case FLTID:
-	  getid(str, buff, &len);
-	  return len;
-    case PI:
-	  return 2;
-    case E:
-	  return 1;
-    case UNARYMINUS:
-	  return 1;
-    case SIN:
-	  return 3;
-    case COS:
-	  return 3;
-    case TAN:
-	  return 3;
-    case LN:
-	  return 2;
-    case POW:
-	  return 3;
-	case SQRT:
-	  return 4;
-    case DIV:
-	  return 1;
-    case MULT:
-	  return 1; 
-	case OPAREN:
-	  return 1;
-    case CPAREN:
-	  return 1;
-    case PLUS:
-	  return 1;
-    case MINUS:
-	  return 1;
-    case SHRIEK:
-	  return 1;
-    case COMMA:
-	  return 1;
-	case QUOTE:
-	  return 1;
-	case EQUALS:
-	  return 1;
-	case LESS:
-	  return 1;
-	case GREATER:
-	  return 1;
-    case SPACE:
-	  return 1;
-    case ERROR:
-	  return 0;
-	case PRINT:
-	  return 5;
-    case LET:
-	  return 3;
-	case DIM:
-	  return 3;
-	case IF:
-	  return 2;
-	case THEN:
-	  return 4;
-	case AND:
-	  return 3;
-	case OR:
-	  return 2;
-	case GOTO:
-	  return 4;
-	case INPUT:
-	  return 5;
-	case REM:
-	  return 3;
-	case FOR:
-	  return 3;
-	case TO:
-	  return 2;
-	case NEXT:
-	  return 4;
-	case STEP:
-	  return 4;
-    case MOD:
-	  return 3;
-    case ABS:
-	  return 3;
-    case LEN:
-	  return 3;
-    case ASCII:
-	  return 5;
-    case ASIN:
-	  return 4;
-    case ACOS:
-	  return 4;
-    case ATAN:
-	  return 4;
-    case INT:
-	  return 3;
-    case RND:
-      return 3;
-    case VAL:
-	  return 3;
-    case CHRSTRING:
-	  return 4;
-	case STRSTRING:
-	  return 4;
-	case LEFTSTRING:
-	  return 5;
-	case RIGHTSTRING:
-	  return 6;
-	case MIDSTRING:
-	  return 4;
-	case STRINGSTRING:
-	  return 7;
+	  return LESS;
+	case '>':
+	  return GREATER;
 	default:
-	  assert(0);
-	  return 0;
-  }
+	  if(!isalpha(*str))
+	  {
+		*len = 0;
+		return ERROR;
+	  }
+
+	  n = 1;
+	  while(isalnum(str[n]))
+		n++;
+	  kw = 0;
+	  if(str[n] == '$')
+		kw = findkeyword(str, n + 1);
+	  if(!kw)
+		kw = findkeyword(str, n);
+	  if(kw)
+	  {
+		*len = kw->len;
+		return kw->token;
+	  }
+
+	  switch(str[n])
+	  {
+		case '$':
+		  if(str[n+1] == '(')
+		  {
+			*len = n + 2;
+			return DIMSTRID;
+		  }
+		  *len = n + 1;
+		  return STRID;
+		case '(':
+		  *len = n + 1;
+		  return DIMFLTID;
+		default:
+		  *len = n;
+		  return FLTID;
+	  }
+  } 
+}
+
+/*
+  look up a keyword.
+  Params: str - the possible keyword
+		  len - its length
+  Returns: the keyword, 0 if it isn't one
+  Notes: one probe of the perfect hash table.
+*/
+static const KEYWORD *findkeyword(const char *str, int len)
+{
+  const KEYWORD *kw;
+
+  if(len < 2 || len > 7)
+	return 0;
+  kw = &keywords[KWHASH(str, len)];
+  if(kw->len == len && !memcmp(kw->name, str, len))
+	return kw;
+
+  return 0;
 }
 
 /*
@@ -2710,66 +4830,6 @@ static int isstring(int token)
   return 0;
 }
 
-/*
-  get a numerical value from the parse string
-  Params: str - the string to search
-          len - return pinter for no chars read
-  Retuns: the value of the string.
-*/
-static double getvalue(const char *str, int *len)
-{
-  double answer;
-  char *end;
-
-  answer = strtod(str, &end);
-  assert(end != str);
-  *len = end - str;
-  return answer;
-}
-
-/*
-  getid - get an id from the parse string:
-  Params: str - string to search
-          out - id output [32 chars max ]
-		  len - return pointer for id length
-  Notes: triggers an error if id > 31 chars
-         the id includes the $ and ( qualifiers.
-*/
-static void getid(const char *str, char *out, int *len)
-{
-  int nread = 0;
-  while(isspace(*str))
-	str++;
-  assert(isalpha(*str));
-  while(isalnum(*str))
-  {
-	if(nread < 31)
-	  out[nread++] = *str++;
-	else
-	{
-      seterror(ERR_IDTOOLONG);
-	  break;
-	}
-  }
-  if(*str == '$')
-  {
-	if(nread < 31)
-	  out[nread++] = *str++;
-	else
-	 seterror(ERR_IDTOOLONG);
-  }
-  if(*str == '(')
-  {
-	if(nread < 31)
-	  out[nread++] = *str++;
-	else
-	  seterror(ERR_IDTOOLONG);
-  }
-  out[nread] = 0;
-  *len = nread;
-}
-
-
 /*
   grab a literal from the parse string.
   Params: dest - destination string
@@ -2866,26 +4926,572 @@ static char *mystrdup(const char *str)
 }
 
 /*
-  concatenate two strings
-  Params: str - firsts string
-          cat - second string
-  Returns: malloced string.
+  read a decimal number, as strtod() does but whatever the locale.
+  Params: str - the string
+		  len - number of characters in the string
+		  x - return pointer for the number, 0 if there is none
+  Returns: number of characters read, -1 if cstrtod() is needed
+  Notes: a number of up to 15 significant digits, scaled by a power
+		 of ten up to 22, is an exact double divided or multiplied
+		 by another, so is correctly rounded by the one operation.
+		 Anything else, and hex, infinity and NaN, is left to cstrtod().
+*/
+static int parsenumber(const char *str, int len, double *x)
+{
+  const char *s = str;
+  const char *end = str + len;
+  const char *digits;
+  double m = 0.0;
+  int nsig = 0;
+  int exponent = 0;
+  int e = 0;
+  int esign = 1;
+  int neg = 0;
+  int exact = 1;
+
+  *x = 0.0;
+  while(s < end && isspace((unsigned char) *s))
+	s++;
+  if(s < end && (*s == '+' || *s == '-'))
+	neg = *s++ == '-';
+  if(s < end && (*s == 'i' || *s == 'I' || *s == 'n' || *s == 'N'))
+	return -1;
+  if(end - s > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+	return -1;
+
+  digits = s;
+  for(;s < end && isdigit((unsigned char) *s);s++)
+  {
+	if(nsig < 15)
+	{
+	  m = m * 10 + (*s - '0');
+	  if(m != 0.0)
+		nsig++;
+	}
+	else
+	{
+	  exponent++;
+	  if(*s != '0')
+		exact = 0;
+	}
+  }
+  if(s < end && *s == '.')
+  {
+	s++;
+	for(;s < end && isdigit((unsigned char) *s);s++)
+	{
+	  if(nsig < 15)
+	  {
+		m = m * 10 + (*s - '0');
+		exponent--;
+		if(m != 0.0)
+		  nsig++;
+	  }
+	  else if(*s != '0')
+		exact = 0;
+	}
+	if(s == digits + 1)
+	  return 0;
+  }
+  else if(s == digits)
+	return 0;
+
+  if(end - s > 1 && (*s == 'e' || *s == 'E'))
+  {
+	len = 1;
+	if(s[1] == '+' || s[1] == '-')
+	{
+	  esign = s[1] == '-' ? -1 : 1;
+	  len = 2;
+	}
+	if(end - s > len && isdigit((unsigned char) s[len]))
+	{
+	  for(s+=len;s < end && isdigit((unsigned char) *s);s++)
+		if(e < 10000)
+		  e = e * 10 + (*s - '0');
+	  exponent += esign * e;
+	}
+  }
+
+  if(!exact)
+	return -1;
+  if(m != 0.0)
+  {
+	if(exponent < -22 || exponent > 22)
+	  return -1;
+	m = scaleten(m, exponent);
+  }
+  *x = neg ? -m : m;
+
+  return s - str;
+}
+
+/*
+  read a number as strtod() does in the C locale.
+  Params: str - the string
+		  len - number of characters in the string
+		  x - return pointer for the number
+  Returns: number of characters read, 0 if there is no number,
+		   -1 on out of memory
+  Notes: for what parsenumber() can't do. Only the characters which
+		 may be part of a number are passed to strtod(), with the
+		 point changed to the locale's, so the locale makes no
+		 difference.
+*/
+static int cstrtod(const char *str, int len, double *x)
+{
+  char buff[MAXDIGITS + 64];
+  char *temp = buff;
+  const char *point;
+  char *stop;
+  int plen;
+  int dot = -1;
+  int n = 0;
+  int i;
+  int j = 0;
+
+  while(n < len && str[n] && (isalnum((unsigned char) str[n]) || strchr(".+-()_", str[n])))
+	n++;
+
+  point = localeconv()->decimal_point;
+  plen = (int) strlen(point);
+  if(n + plen >= (int) sizeof(buff))
+  {
+	temp = malloc(n + plen + 1);
+	if(!temp)
+	  return -1;
+  }
+  for(i=0;i<n;i++)
+  {
+	if(str[i] == '.' && dot == -1)
+	{
+	  dot = j;
+	  memcpy(temp + j, point, plen);
+	  j += plen;
+	}
+	else
+	  temp[j++] = str[i];
+  }
+  temp[j] = 0;
+
+  *x = strtod(temp, &stop);
+  j = stop - temp;
+  if(dot != -1 && j > dot)
+	j -= plen - 1;
+  if(temp != buff)
+	free(temp);
+
+  return j;
+}
+
+/*
+  format a number as printf("%g") does.
+  Params: buff - output, at least 32 characters
+		  x - the number
+  Returns: number of characters written
+  Notes: the six digits are found by scaling into the range 100000 to
+		 999999 with one rounding. Only if what is dropped is too close
+		 to a half to be sure of rounding the same way, or the number
+		 is out of range, is formatg() used.
+*/
+static int formatnumber(char *buff, double x)
+{
+  char digits[8];
+  double y;
+  double r;
+  long n;
+  int e;
+  int len = 0;
+  int last;
+  int i;
+
+  if(x == 0.0)
+  {
+	if(1.0 / x < 0)
+	  buff[len++] = '-';
+	buff[len++] = '0';
+	buff[len] = 0;
+	return len;
+  }
+  y = fabs(x);
+  if(!(y < 1e26 && y >= 1e-16))
+	return formatg(buff, x);
+
+  if(y < 1e6 && y == floor(y))
+  {
+	r = y;
+	e = 5;
+	while(r < 1e5)
+	{
+	  r *= 10;
+	  e--;
+	}
+  }
+  else
+  {
+	e = (int) floor(log10(y));
+	r = scaleten(y, 5 - e);
+	if(r >= 1e6)
+	  r = scaleten(y, 5 - ++e);
+	else if(r < 1e5)
+	  r = scaleten(y, 5 - --e);
+	if(fabs(r - floor(r) - 0.5) < 1e-6)
+	  return formatg(buff, x);
+	r = floor(r + 0.5);
+	if(r >= 1e6)
+	{
+	  r = 1e5;
+	  e++;
+	}
+  }
+
+  n = (long) r;
+  for(i=5;i>=0;i--)
+  {
+	digits[i] = (char) ('0' + n % 10);
+	n /= 10;
+  }
+  for(last=5;last>0 && digits[last] == '0';last--)
+	continue;
+
+  if(x < 0)
+	buff[len++] = '-';
+  if(e >= -4 && e < 6)
+  {
+	if(e < 0)
+	{
+	  buff[len++] = '0';
+	  buff[len++] = '.';
+	  for(i=-1;i>e;i--)
+		buff[len++] = '0';
+	  for(i=0;i<=last;i++)
+		buff[len++] = digits[i];
+	}
+	else
+	{
+	  for(i=0;i<=e;i++)
+		buff[len++] = digits[i];
+	  if(last > e)
+		buff[len++] = '.';
+	  for(;i<=last;i++)
+		buff[len++] = digits[i];
+	}
+  }
+  else
+  {
+	buff[len++] = digits[0];
+	if(last > 0)
+	  buff[len++] = '.';
+	for(i=1;i<=last;i++)
+	  buff[len++] = digits[i];
+	buff[len++] = 'e';
+	buff[len++] = e < 0 ? '-' : '+';
+	if(e < 0)
+	  e = -e;
+	if(e >= 100)
+	  buff[len++] = (char) ('0' + e / 100);
+	buff[len++] = (char) ('0' + e / 10 % 10);
+	buff[len++] = (char) ('0' + e % 10);
+  }
+  buff[len] = 0;
+
+  return len;
+}
+
+/*
+  format a number with sprintf("%g") in the C locale.
+  Params: buff - output, at least 32 characters
+		  x - the number
+  Returns: number of characters written
+  Notes: the locale's point is changed back to a '.'.
 */
-static char *mystrconcat(const char *str, const char *cat)
+static int formatg(char *buff, double x)
 {
+  const char *point = localeconv()->decimal_point;
+  char *ptr;
   int len;
-  char *answer;
+  int plen;
 
-  len = strlen(str) + strlen(cat);
-  answer = malloc(len + 1);
-  if(answer)
+  len = sprintf(buff, "%g", x);
+  plen = (int) strlen(point);
+  if(strcmp(point, ".") && (ptr = strstr(buff, point)) != 0)
   {
-    strcpy(answer, str);
-    strcat(answer, cat);
+	*ptr = '.';
+	memmove(ptr + 1, ptr + plen, len - (ptr - buff) - plen + 1);
+	len -= plen - 1;
+  }
+
+  return len;
+}
+
+/*
+  multiply by a power of ten.
+  Params: x - the number
+		  n - the power, -22 to 22
+  Returns: x * 10^n, with one rounding
+*/
+static double scaleten(double x, int n)
+{
+  if(n >= 0)
+	return x * powersoften[n];
+  return x / powersoften[-n];
+}
+
+/*
+  allocate memory for a run.
+  Params: size - bytes wanted
+  Returns: the memory, 0 on out of memory
+  Notes: from the arena if the interpreter has one, rounded up to a
+		 size class so freed blocks can be reused.
+*/
+static void *runalloc(mb_context *ctx, size_t size)
+{
+  BLOCKHEAD *head;
+  BIGBLOCK *big;
+  void *answer;
+  size_t csize = 16;
+  int cls = 0;
+
+  if(!ctx->usearena)
+	return malloc(size);
+
+  while(csize < size && cls < NCLASSES)
+  {
+	csize *= 2;
+	cls++;
+  }
+
+  if(cls == NCLASSES)
+  {
+	big = malloc(sizeof(BIGBLOCK) + size);
+	if(!big)
+	  return 0;
+	big->prev = 0;
+	big->next = ctx->bigblocks;
+	if(ctx->bigblocks)
+	  ctx->bigblocks->prev = big;
+	ctx->bigblocks = big;
+	big->size = size;
+	big->head.cls = BIGCLASS;
+	return big + 1;
+  }
+
+  if(ctx->freeblocks[cls])
+  {
+	answer = ctx->freeblocks[cls];
+	ctx->freeblocks[cls] = *(void **) answer;
+	return answer;
+  }
+
+  if((size_t) (ctx->bumpend - ctx->bump) < sizeof(BLOCKHEAD) + csize)
+	if(newchunk(ctx) == -1)
+	  return 0;
+  head = (BLOCKHEAD *) ctx->bump;
+  head->cls = cls;
+  ctx->bump += sizeof(BLOCKHEAD) + csize;
+
+  return head + 1;
+}
+
+/*
+  resize memory from runalloc().
+  Params: ptr - the memory, may be 0
+		  size - bytes wanted
+  Returns: the memory, 0 on out of memory (ptr is left alone)
+*/
+static void *runrealloc(mb_context *ctx, void *ptr, size_t size)
+{
+  BLOCKHEAD *head;
+  size_t oldsize;
+  void *answer;
+
+  if(!ctx->usearena)
+	return realloc(ptr, size);
+  if(!ptr)
+	return runalloc(ctx, size);
+
+  head = (BLOCKHEAD *) ptr - 1;
+  if(head->cls == BIGCLASS)
+	oldsize = ((BIGBLOCK *) ptr - 1)->size;
+  else
+	oldsize = (size_t) 16 << head->cls;
+  if(size <= oldsize)
+	return ptr;
+
+  answer = runalloc(ctx, size);
+  if(!answer)
+	return 0;
+  memcpy(answer, ptr, oldsize);
+  runfree(ctx, ptr);
+
+  return answer;
+}
+
+/*
+  free memory from runalloc().
+  Params: ptr - the memory, may be 0
+  Notes: arena blocks go on the free list for their class.
+*/
+static void runfree(mb_context *ctx, void *ptr)
+{
+  BLOCKHEAD *head;
+  BIGBLOCK *big;
+
+  if(!ctx->usearena)
+  {
+	free(ptr);
+	return;
+  }
+  if(!ptr)
+	return;
+
+  head = (BLOCKHEAD *) ptr - 1;
+  if(head->cls == BIGCLASS)
+  {
+	big = (BIGBLOCK *) ptr - 1;
+	if(big->prev)
+	  big->prev->next = big->next;
+	else
+	  ctx->bigblocks = big->next;
+	if(big->next)
+	  big->next->prev = big->prev;
+	free(big);
+  }
+  else
+  {
+	*(void **) ptr = ctx->freeblocks[head->cls];
+	ctx->freeblocks[head->cls] = ptr;
+  }
+}
+
+/*
+  make a string for a run.
+  Params: str - the characters, 0 to leave them unset
+		  len - number of characters
+  Returns: the string, 0 on out of memory
+*/
+static STRING *newstring(mb_context *ctx, const char *str, int len)
+{
+  STRING *answer;
+
+  answer = runalloc(ctx, STRINGSIZE(len));
+  if(!answer)
+	return 0;
+  answer->len = len;
+  answer->cap = len;
+  answer->refs = 1;
+  if(str)
+	memcpy(answer->str, str, len);
+  answer->str[len] = 0;
+
+  return answer;
+}
+
+/*
+  give up a reference to a string.
+  Params: str - the string, may be 0
+  Notes: the string is freed when nothing holds it.
+*/
+static void dropstring(mb_context *ctx, STRING *str)
+{
+  if(str && --str->refs == 0)
+	runfree(ctx, str);
+}
+
+/*
+  concatenate a list of strings for a run.
+  Params: strs - the strings
+		  n - number of strings
+  Returns: the result, 0 on out of memory
+  Notes: the result is sized once, and each string copied once.
+*/
+static STRING *runconcat(mb_context *ctx, const STRVAL *strs, int n)
+{
+  STRING *answer;
+  int len = 0;
+  int i;
+
+  for(i=0;i<n;i++)
+	len += strs[i].len;
+  answer = newstring(ctx, 0, len);
+  if(!answer)
+	return 0;
+  len = 0;
+  for(i=0;i<n;i++)
+  {
+	memcpy(answer->str + len, strs[i].str, strs[i].len);
+	len += strs[i].len;
   }
+
   return answer;
 }
 
+/*
+  move the arena on to its next slab.
+  Returns: 0 on success, -1 on out of memory
+  Notes: slabs are kept from earlier runs, so a new one is only
+		 allocated when a run needs more than any before it.
+*/
+static int newchunk(mb_context *ctx)
+{
+  CHUNK *next;
+
+  next = ctx->chunk ? ctx->chunk->next : ctx->chunks;
+  if(!next)
+  {
+	next = malloc(sizeof(CHUNK) + ARENACHUNK);
+	if(!next)
+	  return -1;
+	next->next = 0;
+	if(ctx->chunk)
+	  ctx->chunk->next = next;
+	else
+	  ctx->chunks = next;
+  }
+  ctx->chunk = next;
+  ctx->bump = (char *) next->data;
+  ctx->bumpend = ctx->bump + ARENACHUNK;
+
+  return 0;
+}
+
+/*
+  give back everything allocated from the arena, keeping the slabs.
+*/
+static void resetarena(mb_context *ctx)
+{
+  BIGBLOCK *big;
+  int i;
+
+  while(ctx->bigblocks)
+  {
+	big = ctx->bigblocks;
+	ctx->bigblocks = big->next;
+	free(big);
+  }
+  for(i=0;i<NCLASSES;i++)
+	ctx->freeblocks[i] = 0;
+  ctx->chunk = 0;
+  ctx->bump = 0;
+  ctx->bumpend = 0;
+}
+
+/*
+  free the arena's slabs.
+*/
+static void freearena(mb_context *ctx)
+{
+  CHUNK *next;
+
+  resetarena(ctx);
+  while(ctx->chunks)
+  {
+	next = ctx->chunks->next;
+	free(ctx->chunks);
+	ctx->chunks = next;
+  }
+}
+
 /*
   compute x!  
 */
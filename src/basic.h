@@ -0,0 +1,44 @@
+#ifndef basic_h
+#define basic_h
+/*
+  Minibasic header file
+  By Malcolm Mclean
+*/
+
+/* instruction dispatch methods */
+#define BASIC_SWITCH 0        /* portable switch loop */
+#define BASIC_THREADED 1      /* computed goto, GNU C only */
+
+/* when PRINT output is written out */
+#define BASIC_FLUSHAUTO 0     /* by line if output is a terminal, else in blocks */
+#define BASIC_FLUSHFULL 1     /* in blocks */
+#define BASIC_FLUSHLINE 2     /* at the end of each line */
+
+typedef struct mb_context mb_context;
+typedef struct mb_program mb_program;
+
+/* caller's I/O functions, arg is as passed when they were set */
+typedef int (*mb_reader)(void *arg, char *buff, int size);  /* returns count read, 0 at end */
+typedef void (*mb_writer)(void *arg, const char *str, int len);
+
+int basic(const char *script, FILE *in, FILE *out, FILE *err);
+int basicdispatch(int method);
+
+mb_context *mb_create(void);
+void mb_destroy(mb_context *ctx);
+void mb_usearena(mb_context *ctx, int on);
+void mb_flushmode(mb_context *ctx, int mode);
+void mb_setoutput(mb_context *ctx, char *buff, size_t size);
+size_t mb_outputlen(const mb_context *ctx);
+void mb_setwriter(mb_context *ctx, mb_writer write, void *arg);
+void mb_seterrorwriter(mb_context *ctx, mb_writer write, void *arg);
+void mb_setinput(mb_context *ctx, const char *buff, size_t len);
+void mb_setreader(mb_context *ctx, mb_reader read, void *arg);
+int mb_run(mb_context *ctx, const char *script, FILE *in, FILE *out, FILE *err);
+
+/* load errors go to err; mb_run() sends them to the error writer if set */
+mb_program *mb_compile(const char *script, FILE *err);
+void mb_freeprogram(mb_program *prog);
+int mb_execute(mb_context *ctx, const mb_program *prog, FILE *in, FILE *out, FILE *err);
+
+#endif
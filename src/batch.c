@@ -0,0 +1,434 @@
+/*****************************************************************
+*                     Mini BASIC batch runner                    *
+*                                                                *
+*  Runs compiled programs over many jobs, on a pool of threads.  *
+*  Each thread has its own interpreter and its own deque of      *
+*  jobs, and steals from the others when its deque runs dry, so  *
+*  a few long jobs don't leave the other threads idle.           *
+*****************************************************************/
+
+/* POSIX threads unless asked not to, else jobs run one by one */
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(BASIC_NOTHREADS)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define POOLTHREADS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "basic.h"
+#include "batch.h"
+
+#ifdef POOLTHREADS
+#include <pthread.h>
+#endif
+
+/* a job's output, as it is written */
+typedef struct
+{
+  char *str;                   /* nul-terminated */
+  size_t len;
+  size_t size;                 /* space in str */
+  int failed;                  /* set if out of memory */
+} OUTPUT;
+
+typedef struct
+{
+  int *jobs;                   /* indices into the batch's jobs */
+  int size;                    /* space in jobs */
+  int top;                     /* other threads steal from here */
+  int bottom;                  /* owner takes from just below here */
+#ifdef POOLTHREADS
+  pthread_mutex_t lock;
+#endif
+} DEQUE;
+
+typedef struct
+{
+  struct mb_pool *pool;
+  int index;                   /* place in the pool */
+  mb_context *ctx;             /* this thread's interpreter */
+  DEQUE deque;                 /* this thread's jobs */
+#ifdef POOLTHREADS
+  pthread_t thread;
+#endif
+} WORKER;
+
+struct mb_pool
+{
+  WORKER *workers;
+  int nworkers;                /* workers with an interpreter */
+  int nthreads;                /* threads started, 0 to run jobs inline */
+#ifdef POOLTHREADS
+  pthread_mutex_t lock;
+  pthread_cond_t work;         /* signalled when a batch is posted */
+  pthread_cond_t done;         /* signalled when the last thread goes idle */
+  int quit;
+#endif
+  unsigned long batch;         /* count of batches posted */
+  mb_job *jobs;                /* jobs of the current batch */
+  int active;                  /* threads still working on the batch */
+  int failed;                  /* jobs which didn't succeed */
+};
+
+#ifdef POOLTHREADS
+static void *worker(void *arg);
+static int takejob(WORKER *w);
+static int popjob(DEQUE *dq);
+static int stealjob(DEQUE *dq);
+#endif
+static void runjob(mb_context *ctx, mb_job *job);
+static void writejob(void *arg, const char *str, int len);
+
+/*
+  create a pool of threads to run jobs.
+  Params: nthreads - number of threads, 0 to run jobs in the caller
+  Returns: the pool, 0 on fail.
+*/
+mb_pool *mb_createpool(int nthreads)
+{
+  mb_pool *pool;
+  int i;
+
+#ifndef POOLTHREADS
+  nthreads = 0;
+#endif
+  if(nthreads < 0)
+	nthreads = 0;
+
+  pool = malloc(sizeof(mb_pool));
+  if(!pool)
+	return 0;
+  memset(pool, 0, sizeof(mb_pool));
+#ifdef POOLTHREADS
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+#endif
+
+  pool->workers = malloc((nthreads ? nthreads : 1) * sizeof(WORKER));
+  if(!pool->workers)
+  {
+	mb_destroypool(pool);
+	return 0;
+  }
+  for(i=0;i<(nthreads ? nthreads : 1);i++)
+  {
+	memset(&pool->workers[i], 0, sizeof(WORKER));
+	pool->workers[i].pool = pool;
+	pool->workers[i].index = i;
+	pool->workers[i].ctx = mb_create();
+	if(!pool->workers[i].ctx)
+	{
+	  mb_destroypool(pool);
+	  return 0;
+	}
+	mb_usearena(pool->workers[i].ctx, 1);
+#ifdef POOLTHREADS
+	pthread_mutex_init(&pool->workers[i].deque.lock, 0);
+#endif
+	pool->nworkers++;
+  }
+
+#ifdef POOLTHREADS
+  for(i=0;i<nthreads;i++)
+  {
+	if(pthread_create(&pool->workers[i].thread, 0, worker, &pool->workers[i]))
+	{
+	  mb_destroypool(pool);
+	  return 0;
+	}
+	pool->nthreads++;
+  }
+#endif
+
+  return pool;
+}
+
+/*
+  stop the threads of a pool and free it.
+  Params: pool - pool from mb_createpool()
+  Notes: must not be called while a batch is running.
+*/
+void mb_destroypool(mb_pool *pool)
+{
+  int i;
+
+  if(!pool)
+	return;
+
+#ifdef POOLTHREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for(i=0;i<pool->nthreads;i++)
+	pthread_join(pool->workers[i].thread, 0);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+#endif
+
+  for(i=0;i<pool->nworkers;i++)
+  {
+#ifdef POOLTHREADS
+	pthread_mutex_destroy(&pool->workers[i].deque.lock);
+#endif
+	free(pool->workers[i].deque.jobs);
+	mb_destroy(pool->workers[i].ctx);
+  }
+  if(pool->workers)
+	free(pool->workers);
+  free(pool);
+}
+
+/*
+  run a list of jobs.
+  Params: pool - pool from mb_createpool()
+		  jobs - the jobs, output and result are set for each
+		  njobs - number of jobs
+  Returns: the number of jobs which didn't succeed, -1 if out of memory.
+  Notes: returns when every job has finished. Only one batch may
+		 run on a pool at a time.
+		 The jobs are dealt out evenly, and threads that finish
+		 early steal jobs from the ones still busy.
+*/
+int mb_batch(mb_pool *pool, mb_job *jobs, int njobs)
+{
+#ifdef POOLTHREADS
+  DEQUE *dq;
+  int per;
+  int ii;
+#endif
+  int i;
+  int answer = 0;
+
+  if(pool->nthreads == 0)
+  {
+	for(i=0;i<njobs;i++)
+	{
+	  runjob(pool->workers[0].ctx, &jobs[i]);
+	  if(jobs[i].result)
+		answer++;
+	}
+	return answer;
+  }
+
+#ifdef POOLTHREADS
+  if(njobs <= 0)
+	return 0;
+
+  per = (njobs + pool->nthreads - 1) / pool->nthreads;
+  pthread_mutex_lock(&pool->lock);
+  for(i=0;i<pool->nthreads;i++)
+  {
+	dq = &pool->workers[i].deque;
+	if(dq->size < per)
+	{
+	  free(dq->jobs);
+	  dq->jobs = malloc(per * sizeof(int));
+	  if(!dq->jobs)
+	  {
+		dq->size = 0;
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	  }
+	  dq->size = per;
+	}
+	dq->top = 0;
+	dq->bottom = 0;
+	for(ii = i * njobs / pool->nthreads; ii < (i+1) * njobs / pool->nthreads; ii++)
+	  dq->jobs[dq->bottom++] = ii;
+  }
+
+  pool->jobs = jobs;
+  pool->failed = 0;
+  pool->active = pool->nthreads;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->work);
+  while(pool->active > 0)
+	pthread_cond_wait(&pool->done, &pool->lock);
+  answer = pool->failed;
+  pool->jobs = 0;
+  pthread_mutex_unlock(&pool->lock);
+#endif
+
+  return answer;
+}
+
+#ifdef POOLTHREADS
+/*
+  thread function, runs jobs until the pool is destroyed.
+  Params: arg - the thread's WORKER
+*/
+static void *worker(void *arg)
+{
+  WORKER *w = arg;
+  mb_pool *pool = w->pool;
+  unsigned long seen = 0;
+  mb_job *jobs;
+  int failed;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  while(1)
+  {
+	while(!pool->quit && pool->batch == seen)
+	  pthread_cond_wait(&pool->work, &pool->lock);
+	if(pool->quit)
+	  break;
+	seen = pool->batch;
+	jobs = pool->jobs;
+	pthread_mutex_unlock(&pool->lock);
+
+	failed = 0;
+	while((i = takejob(w)) != -1)
+	{
+	  runjob(w->ctx, &jobs[i]);
+	  if(jobs[i].result)
+		failed++;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->failed += failed;
+	if(--pool->active == 0)
+	  pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+/*
+  get the next job for a thread.
+  Params: w - the thread's WORKER
+  Returns: index of the job, -1 when the batch has no jobs left.
+  Notes: takes from its own deque first, then steals from the
+		 others in turn.
+*/
+static int takejob(WORKER *w)
+{
+  mb_pool *pool = w->pool;
+  int answer;
+  int i;
+
+  answer = popjob(&w->deque);
+  for(i=1;answer == -1 && i<pool->nthreads;i++)
+	answer = stealjob(&pool->workers[(w->index + i) % pool->nthreads].deque);
+
+  return answer;
+}
+
+/*
+  take a job from the owner's end of a deque.
+  Params: dq - the thread's own deque
+  Returns: index of the job, -1 if empty.
+*/
+static int popjob(DEQUE *dq)
+{
+  int answer = -1;
+
+  pthread_mutex_lock(&dq->lock);
+  if(dq->bottom > dq->top)
+	answer = dq->jobs[--dq->bottom];
+  pthread_mutex_unlock(&dq->lock);
+
+  return answer;
+}
+
+/*
+  take a job from the far end of another thread's deque.
+  Params: dq - deque to steal from
+  Returns: index of the job, -1 if empty.
+*/
+static int stealjob(DEQUE *dq)
+{
+  int answer = -1;
+
+  pthread_mutex_lock(&dq->lock);
+  if(dq->bottom > dq->top)
+	answer = dq->jobs[dq->top++];
+  pthread_mutex_unlock(&dq->lock);
+
+  return answer;
+}
+#endif
+
+/*
+  run one job.
+  Params: ctx - interpreter to run it on
+		  job - the job, output and result are set
+  Notes: INPUT reads the job's input where it is, and PRINT
+		 writes straight into the output, so no streams are
+		 opened.
+*/
+static void runjob(mb_context *ctx, mb_job *job)
+{
+  OUTPUT out;
+
+  job->output = 0;
+  job->outputlen = 0;
+  job->result = -1;
+
+  out.size = 256;
+  out.len = 0;
+  out.failed = 0;
+  out.str = malloc(out.size);
+  if(!out.str)
+	return;
+  out.str[0] = 0;
+
+  mb_setinput(ctx, job->input ? job->input : "", job->input ? job->inputlen : 0);
+  mb_setwriter(ctx, writejob, &out);
+  mb_seterrorwriter(ctx, job->err ? 0 : writejob, &out);
+  job->result = mb_execute(ctx, job->prog, 0, 0, job->err);
+  mb_setinput(ctx, 0, 0);
+  mb_setwriter(ctx, 0, 0);
+  mb_seterrorwriter(ctx, 0, 0);
+
+  if(out.failed)
+  {
+	free(out.str);
+	job->result = -1;
+	return;
+  }
+  job->output = out.str;
+  job->outputlen = out.len;
+}
+
+/*
+  writer for a job's output.
+  Params: arg - the job's OUTPUT
+		  str - characters to add
+		  len - number of characters
+  Notes: grows the output by doubling, and keeps it nul-terminated.
+*/
+static void writejob(void *arg, const char *str, int len)
+{
+  OUTPUT *out = arg;
+  size_t size;
+  char *temp;
+
+  if(out->failed)
+	return;
+  if(out->len + len >= out->size)
+  {
+	size = out->size;
+	while(out->len + len >= size)
+	  size *= 2;
+	temp = realloc(out->str, size);
+	if(!temp)
+	{
+	  out->failed = 1;
+	  return;
+	}
+	out->str = temp;
+	out->size = size;
+  }
+  memcpy(out->str + out->len, str, len);
+  out->len += len;
+  out->str[out->len] = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef batch_h
+#define batch_h
+/*
+  Minibasic batch runner header file
+  include basic.h first.
+*/
+
+/* one run of a program */
+typedef struct
+{
+  const mb_program *prog;  /* program to run, from mb_compile() */
+  const char *input;       /* INPUT reads from here */
+  size_t inputlen;         /* length of input */
+  FILE *err;               /* errors reported here, 0 to put them in output */
+  char *output;            /* set to what PRINT wrote, free() it */
+  size_t outputlen;        /* length of output */
+  int result;              /* 0 on success, 1 on run time error, -1 no memory */
+} mb_job;
+
+typedef struct mb_pool mb_pool;
+
+mb_pool *mb_createpool(int nthreads);
+void mb_destroypool(mb_pool *pool);
+int mb_batch(mb_pool *pool, mb_job *jobs, int njobs);
+
+#endif
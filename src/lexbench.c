@@ -0,0 +1,88 @@
+/*
+  lexer benchmark for MiniBasic.
+  Tokenizes a generated script of several megabytes a number of
+  times, and prints the throughput in MB/s.
+  tokenize() is static, so this includes basic.c rather than
+  linking with it. Build with
+	cc -O2 -o lexbench lexbench.c -lm
+*/
+
+#include <time.h>
+
+#include "basic.c"
+
+#define SCRIPTSIZE (8 << 20)  /* bytes of script generated */
+#define REPEATS 20            /* times it is tokenized */
+
+/*
+  lines typical of a script, repeated to make up the test
+*/
+static const char *testlines[] =
+{
+  "LET TOTAL = TOTAL + PRICE(I) * QUANTITY(I) / 100\n",
+  "IF NAME$ = \"Fred\" AND COUNT > 10 THEN 200\n",
+  "PRINT LEFT$(NAME$, 3), MID$(ADDRESS$, I, 1), LEN(ADDRESS$)\n",
+  "FOR INDEX = 1 TO NUMBEROFITEMS STEP 2\n",
+  "LET X = sin(ANGLE * PI / 180) + sqrt(DX * DX + DY * DY)\n",
+  "NEXT INDEX\n",
+};
+
+int main(int argc, char **argv)
+{
+  mb_context ctx;
+  mb_program *prog;
+  char *script;
+  size_t size = 0;
+  size_t len;
+  int nlines = sizeof(testlines) / sizeof(testlines[0]);
+  int repeats = REPEATS;
+  int i;
+  clock_t start;
+  double secs;
+
+  if(argc > 1)
+	repeats = atoi(argv[1]);
+  if(repeats < 1)
+	repeats = 1;
+
+  script = malloc(SCRIPTSIZE + 128);
+  prog = malloc(sizeof(mb_program));
+  if(!script || !prog)
+  {
+	fprintf(stderr, "Out of memory\n");
+	return EXIT_FAILURE;
+  }
+  for(i=0;size < SCRIPTSIZE;i++)
+  {
+	len = strlen(testlines[i % nlines]);
+	memcpy(script + size, testlines[i % nlines], len);
+	size += len;
+  }
+  script[size] = 0;
+
+  memset(prog, 0, sizeof(mb_program));
+  memset(&ctx, 0, sizeof(mb_context));
+  ctx.build = prog;
+
+  start = clock();
+  for(i=0;i<repeats;i++)
+  {
+	prog->ntokens = 0;
+	if(tokenize(&ctx, script, script + size) == -1)
+	{
+	  fprintf(stderr, "Out of memory\n");
+	  return EXIT_FAILURE;
+	}
+  }
+  secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  printf("%.1f MB script, %d tokens, tokenized %d times\n",
+	size / 1e6, prog->ntokens, repeats);
+  if(secs > 0)
+	printf("%.1f MB/s\n", size * (double) repeats / secs / 1e6);
+
+  mb_freeprogram(prog);
+  free(script);
+
+  return 0;
+}